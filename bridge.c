@@ -0,0 +1,320 @@
+/*
+ *  bridge.c - keeping a selection in sync across several displays
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "xcbclip.h"
+#include "libxcbclip.h"
+
+/* Each display has its own libxcbclip context, driven by its own
+ * thread. When another client takes the selection on a display, its
+ * thread reads it once into a buffer that becomes the latest value,
+ * and wakes the threads of the other displays up, which all set their
+ * selection to that same buffer. The contexts don't report the
+ * selections they set themselves, so values don't bounce back; values
+ * that come back anyway, through another bridge, are recognised as the
+ * latest one and go no further.
+ */
+
+/** A display being bridged */
+typedef struct {
+  const char *name;
+  XcbClipContext *ctx;
+  int wake[2];           /**< pipe the other threads wake this one with */
+  unsigned long generation; /**< latest value set on the display */
+  bool reading;          /**< the selection is being read */
+  bool changed;          /**< it changed again while being read */
+  double deadline;       /**< to give up on the read, or 0 */
+} BridgeDisplay;
+
+static BridgeDisplay *displays = NULL;
+static size_t displays_count = 0;
+static XcbClipSelection bridge_selection;
+
+/** The latest value, and the display it came from, under the lock */
+static pthread_mutex_t latest_lock = PTHREAD_MUTEX_INITIALIZER;
+static XcbClipBuffer *latest = NULL;
+static unsigned long latest_generation = 0;
+static const BridgeDisplay *latest_origin = NULL;
+
+static void bridge_read(BridgeDisplay *display);
+
+/**
+ * @brief Make a value read from a display the latest, and pass it on
+ *
+ * The buffer is only referenced by the displays; the text is never
+ * copied again.
+ */
+static void bridge_publish(BridgeDisplay *display, const char *data, size_t len)
+{
+  pthread_mutex_lock(&latest_lock);
+
+  size_t latest_len = 0;
+  const char *latest_data = latest ? xcbclip_buffer_data(latest, &latest_len) : NULL;
+  if ( latest_data != NULL && latest_len == len && memcmp(latest_data, data, len) == 0 ) {
+    pthread_mutex_unlock(&latest_lock);
+    return;
+  }
+
+  XcbClipBuffer *buffer = xcbclip_buffer_new(data, len);
+  if ( buffer == NULL ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  xcbclip_buffer_unref(latest);
+  latest = buffer;
+  latest_origin = display;
+  display->generation = ++latest_generation;
+  pthread_mutex_unlock(&latest_lock);
+
+  if ( fverb == OVERBOSE )
+    fprintf(stderr, "%s: %zu bytes from %s\n", progname, len, display->name);
+
+  /* a full pipe already has a wake-up in it */
+  for (size_t i = 0; i < displays_count; i++)
+    if ( &displays[i] != display )
+      while ( write(displays[i].wake[1], "", 1) < 0 && errno == EINTR );
+}
+
+/**
+ * @brief Called once the selection of a display was read
+ */
+static void bridge_got(XcbClipContext *ctx, XcbClipSelection selection,
+		       XcbClipStatus status, const char *data, size_t len,
+		       void *user_data)
+{
+  BridgeDisplay *display = user_data;
+  display->reading = false;
+
+  if ( status == XCBCLIP_OK )
+    bridge_publish(display, data, len);
+  else if ( fverb == OVERBOSE )
+    fprintf(stderr, "%s: can't read the selection on %s: %s\n", progname,
+	    display->name, xcbclip_strerror(status));
+
+  if ( display->changed )
+    bridge_read(display);
+}
+
+/**
+ * @brief Start reading the selection of a display
+ */
+static void bridge_read(BridgeDisplay *display)
+{
+  display->changed = false;
+  display->reading = true;
+  display->deadline = loop_deadline();
+
+  const XcbClipStatus status =
+    xcbclip_get(display->ctx, bridge_selection, bridge_got, display);
+  if ( status != XCBCLIP_OK ) {
+    fprintf(stderr, "%s: %s: %s\n", progname, display->name,
+	    xcbclip_strerror(status));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * @brief Called when another client takes the selection of a display
+ *
+ * Changes that come in while it's being read are coalesced into a
+ * single read once it's over.
+ */
+static void bridge_changed(XcbClipContext *ctx, XcbClipSelection selection,
+			   void *user_data)
+{
+  BridgeDisplay *display = user_data;
+
+  if ( display->reading )
+    display->changed = true;
+  else
+    bridge_read(display);
+}
+
+/**
+ * @brief Set the selection of a display to the latest value, if it's new
+ */
+static void bridge_offer(BridgeDisplay *display)
+{
+  char drain[64];
+  while ( read(display->wake[0], drain, sizeof(drain)) > 0 );
+
+  XcbClipBuffer *buffer = NULL;
+  pthread_mutex_lock(&latest_lock);
+  if ( display->generation != latest_generation ) {
+    display->generation = latest_generation;
+    if ( latest_origin != display )
+      buffer = xcbclip_buffer_ref(latest);
+  }
+  pthread_mutex_unlock(&latest_lock);
+
+  if ( buffer == NULL )
+    return;
+
+  const XcbClipStatus status =
+    xcbclip_set_buffer(display->ctx, bridge_selection, buffer, NULL, NULL);
+  xcbclip_buffer_unref(buffer);
+
+  if ( status != XCBCLIP_OK ) {
+    fprintf(stderr, "%s: %s: %s\n", progname, display->name,
+	    xcbclip_strerror(status));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * @brief Event loop of a display, never returns
+ */
+static void *bridge_thread(void *arg)
+{
+  BridgeDisplay *display = arg;
+
+  while (true) {
+    int timeout = -1;
+    if ( display->reading && display->deadline > 0 ) {
+      const double left = display->deadline - stats_now();
+      timeout = left <= 0 ? 0 :
+	left < INT_MAX / 1000 ? (int)(left * 1000) + 1 : INT_MAX;
+    }
+
+    struct pollfd fds[2] = {
+      { .fd = xcbclip_context_fd(display->ctx), .events = POLLIN },
+      { .fd = display->wake[0], .events = POLLIN }
+    };
+
+    if ( poll(fds, 2, timeout) < 0 && errno != EINTR ) {
+      perrorf("%s: %s", progname, __FUNCTION__);
+      exit(EXIT_FAILURE);
+    }
+
+    if ( fds[1].revents )
+      bridge_offer(display);
+
+    if ( xcbclip_dispatch(display->ctx) != XCBCLIP_OK ) {
+      fprintf(stderr, "%s: connection to %s lost\n", progname, display->name);
+      exit(EXIT_FAILURE);
+    }
+
+    /* an owner that stopped answering doesn't hold the display up */
+    if ( display->reading && display->deadline > 0 &&
+	 stats_now() >= display->deadline ) {
+      if ( fverb != OSILENT )
+	fprintf(stderr, "%s: timed out reading the selection on %s\n",
+		progname, display->name);
+      xcbclip_cancel(display->ctx, bridge_selection);
+      display->reading = false;
+      if ( display->changed )
+	bridge_read(display);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Keep a selection the same on several displays, until killed
+ * @param names Displays to bridge, comma-separated
+ * @param selection Selection to bridge, as given to --selection
+ *
+ * The value the first display has when the bridge starts is set on
+ * all the others.
+ */
+void do_bridge(char *names, char selection)
+{
+  switch(selection) {
+  case 'p': bridge_selection = XCBCLIP_PRIMARY; break;
+  case 's': bridge_selection = XCBCLIP_SECONDARY; break;
+  case 'c': bridge_selection = XCBCLIP_CLIPBOARD; break;
+  default:
+    fprintf(stderr, "%s: cut buffers can't be bridged\n", progname);
+    exit(EXIT_FAILURE);
+  }
+
+  for (char *name = strtok(names, ","); name; name = strtok(NULL, ",")) {
+    displays = realloc(displays, (displays_count + 1) * sizeof(BridgeDisplay));
+    if ( displays == NULL ) {
+      perrorf("%s: %s", progname, __FUNCTION__);
+      exit(EXIT_FAILURE);
+    }
+
+    BridgeDisplay *display = &displays[displays_count++];
+    *display = (BridgeDisplay){ .name = name };
+
+    const XcbClipStatus status = xcbclip_context_new(name, &display->ctx);
+    if ( status != XCBCLIP_OK ) {
+      fprintf(stderr, "%s: can't open display: %s\n", progname, name);
+      exit(EXIT_FAILURE);
+    }
+
+    if ( pipe(display->wake) != 0 ) {
+      perrorf("%s: %s", progname, __FUNCTION__);
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 2; i++)
+      fcntl(display->wake[i], F_SETFL, fcntl(display->wake[i], F_GETFL) | O_NONBLOCK);
+  }
+
+  if ( displays_count < 2 ) {
+    fprintf(stderr, "%s: --bridge needs at least two displays\n", progname);
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < displays_count; i++) {
+    const XcbClipStatus status =
+      xcbclip_watch(displays[i].ctx, bridge_selection, bridge_changed, &displays[i]);
+    if ( status != XCBCLIP_OK ) {
+      fprintf(stderr, "%s: %s: %s\n", progname, displays[i].name,
+	      xcbclip_strerror(status));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if ( fverb != OSILENT )
+    fprintf(stderr, "%s: bridging %zu displays\n", progname, displays_count);
+
+  /* threads don't survive fork(), so they're started in the child */
+  go_background();
+
+  bridge_read(&displays[0]);
+
+  /* the calling thread runs the first display */
+  for (size_t i = 1; i < displays_count; i++) {
+    pthread_t tid;
+    const int error = pthread_create(&tid, NULL, bridge_thread, &displays[i]);
+    if ( error != 0 ) {
+      errno = error;
+      perrorf("%s: %s", progname, __FUNCTION__);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  bridge_thread(&displays[0]);
+}
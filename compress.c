@@ -0,0 +1,242 @@
+/*
+ *  compress.c - compression of selection data between xcbclip instances
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#ifdef HAVE_ZSTD
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <zstd.h>
+
+#include "xcbclip.h"
+
+/* The data is compressed in independent blocks, each one a complete
+ * zstd frame; concatenated frames are a valid zstd stream, so the
+ * reading side doesn't need to know about the blocks at all.
+ */
+
+/** Size of the blocks compressed in parallel */
+#define XC_ZSTD_BLOCK (4 << 20)
+/** Compression level; the faster levels already do well on text */
+#define XC_ZSTD_LEVEL 3
+/** Most threads to compress with */
+#define XC_ZSTD_THREADS 16
+
+/** A block being compressed */
+typedef struct {
+  const char *in;
+  size_t in_len;
+  char *out;             /**< where the frame goes, ZSTD_compressBound() big */
+  size_t out_len;        /**< length of the frame, or a zstd error code */
+} XcbClipBlock;
+
+/** Work shared by the compressing threads */
+typedef struct {
+  XcbClipBlock *blocks;
+  size_t count;
+  size_t stride;         /**< number of threads */
+  size_t first;          /**< block the thread starts from */
+} XcbClipCompressJob;
+
+/**
+ * @brief Compress every stride-th block of a job
+ *
+ * The blocks are all the same size, so splitting them evenly between
+ * the threads keeps them equally busy without any locking.
+ */
+static void *compress_blocks(void *arg)
+{
+  const XcbClipCompressJob *job = arg;
+  ZSTD_CCtx *cctx = ZSTD_createCCtx();
+
+  for (size_t i = job->first; i < job->count; i += job->stride) {
+    XcbClipBlock *block = &job->blocks[i];
+    block->out_len = cctx == NULL ? (size_t)-1 :
+      ZSTD_compressCCtx(cctx, block->out, ZSTD_compressBound(block->in_len),
+			block->in, block->in_len, XC_ZSTD_LEVEL);
+  }
+
+  ZSTD_freeCCtx(cctx);
+  return NULL;
+}
+
+/**
+ * @brief Compress selection data, on as many cores as it's worth
+ * @param data Data to compress
+ * @param len Length of data
+ * @param out_len Set to the length of the compressed data
+ * @return The compressed data, to be freed by the caller
+ */
+char *compress_data(const char *data, size_t len, size_t *out_len)
+{
+  const size_t count = len ? (len + XC_ZSTD_BLOCK - 1) / XC_ZSTD_BLOCK : 1;
+
+  XcbClipBlock *blocks = calloc(count, sizeof(XcbClipBlock));
+  if ( blocks == NULL ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  /* each block gets its worst case room in a single buffer; the frames
+   * are moved together once they are all done
+   */
+  size_t bound = 0;
+  for (size_t i = 0; i < count; i++) {
+    blocks[i].in = data + i * XC_ZSTD_BLOCK;
+    blocks[i].in_len = i + 1 < count ? XC_ZSTD_BLOCK : len - i * XC_ZSTD_BLOCK;
+    bound += ZSTD_compressBound(blocks[i].in_len);
+  }
+
+  char *out = store_alloc(bound);
+
+  for (size_t i = 0, off = 0; i < count; i++) {
+    blocks[i].out = out + off;
+    off += ZSTD_compressBound(blocks[i].in_len);
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = cpus > 0 ? (size_t)cpus : 1;
+  if ( threads > XC_ZSTD_THREADS )
+    threads = XC_ZSTD_THREADS;
+  if ( threads > count )
+    threads = count;
+
+  pthread_t tids[XC_ZSTD_THREADS];
+  XcbClipCompressJob jobs[XC_ZSTD_THREADS];
+  bool started[XC_ZSTD_THREADS] = { false };
+
+  for (size_t t = 0; t < threads; t++)
+    jobs[t] = (XcbClipCompressJob){ blocks, count, threads, t };
+
+  /* the calling thread takes the first share itself, and the share of
+   * any thread that couldn't be started
+   */
+  for (size_t t = 1; t < threads; t++)
+    started[t] = pthread_create(&tids[t], NULL, compress_blocks, &jobs[t]) == 0;
+
+  for (size_t t = 0; t < threads; t++)
+    if ( !started[t] )
+      compress_blocks(&jobs[t]);
+
+  for (size_t t = 1; t < threads; t++)
+    if ( started[t] )
+      pthread_join(tids[t], NULL);
+
+  size_t off = 0;
+  for (size_t i = 0; i < count; i++) {
+    if ( ZSTD_isError(blocks[i].out_len) ) {
+      fprintf(stderr, "%s: compression failed: %s\n", progname,
+	      ZSTD_getErrorName(blocks[i].out_len));
+      exit(EXIT_FAILURE);
+    }
+
+    memmove(out + off, blocks[i].out, blocks[i].out_len);
+    off += blocks[i].out_len;
+  }
+
+  free(blocks);
+  *out_len = off;
+  return out;
+}
+
+/** Stream being decompressed by decompress_chunk() */
+static ZSTD_DStream *dstream = NULL;
+static char *dstream_buf = NULL;
+/** Last return value of ZSTD_decompressStream(), 0 at the end of a frame */
+static size_t dstream_hint = 0;
+
+/**
+ * @brief Decompress a chunk of a compressed selection
+ * @param data Chunk of compressed data
+ * @param len Length of data
+ * @param sink Called with each piece of decompressed data
+ * @return false if the data is corrupt
+ */
+bool decompress_chunk(const void *data, size_t len,
+		      void (*sink)(const void *data, size_t len))
+{
+  const size_t buf_size = ZSTD_DStreamOutSize();
+
+  if ( dstream == NULL ) {
+    if ( (dstream = ZSTD_createDStream()) == NULL ||
+	 (dstream_buf = malloc(buf_size)) == NULL ) {
+      perrorf("%s: %s", progname, __FUNCTION__);
+      exit(EXIT_FAILURE);
+    }
+    stats_buffer(buf_size);
+    ZSTD_initDStream(dstream);
+  }
+
+  ZSTD_inBuffer in = { data, len, 0 };
+  while ( in.pos < in.size ) {
+    ZSTD_outBuffer out = { dstream_buf, buf_size, 0 };
+
+    dstream_hint = ZSTD_decompressStream(dstream, &out, &in);
+    if ( ZSTD_isError(dstream_hint) )
+      return false;
+
+    if ( out.pos )
+      sink(dstream_buf, out.pos);
+  }
+
+  return true;
+}
+
+/**
+ * @brief Finish decompressing a selection
+ * @param sink Called with the decompressed data still buffered
+ * @return false if the compressed data was cut short
+ */
+bool decompress_finish(void (*sink)(const void *data, size_t len))
+{
+  if ( dstream == NULL )
+    return true;
+
+  /* the whole input was consumed, but the last frame might still have
+   * some output pending
+   */
+  while ( dstream_hint != 0 ) {
+    ZSTD_inBuffer in = { NULL, 0, 0 };
+    ZSTD_outBuffer out = { dstream_buf, ZSTD_DStreamOutSize(), 0 };
+
+    dstream_hint = ZSTD_decompressStream(dstream, &out, &in);
+    if ( ZSTD_isError(dstream_hint) || out.pos == 0 )
+      break;
+
+    sink(dstream_buf, out.pos);
+  }
+
+  const bool complete = dstream_hint == 0;
+
+  ZSTD_freeDStream(dstream);
+  free(dstream_buf);
+  dstream = NULL;
+  dstream_buf = NULL;
+  dstream_hint = 0;
+
+  return complete;
+}
+
+#endif /* HAVE_ZSTD */
@@ -0,0 +1,216 @@
+/*
+ *  convbench.c - microbenchmark of the text conversion kernels
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Runs every conversion kernel the CPU supports over a few kinds of
+ * text and prints one JSON object per kernel, implementation and data
+ * set, with the throughput in GB/s and the speedup over the scalar
+ * implementation:
+ *
+ *   {"kernel":..., "impl":..., "data":..., "size":..., "gb_s":...,
+ *    "speedup":...}
+ *
+ * The size of the data sets defaults to 16 MiB and can be changed with
+ * the first argument.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "xcbclip.h"
+
+typedef enum {
+  KERNEL_IS_ASCII,
+  KERNEL_IS_UTF8,
+  KERNEL_LATIN1_TO_UTF8,
+  KERNEL_UTF8_TO_LATIN1,
+  KERNELS
+} Kernel;
+
+static const char *const kernel_names[KERNELS] = {
+  [KERNEL_IS_ASCII]       = "is_ascii",
+  [KERNEL_IS_UTF8]        = "is_utf8",
+  [KERNEL_LATIN1_TO_UTF8] = "latin1_to_utf8",
+  [KERNEL_UTF8_TO_LATIN1] = "utf8_to_latin1"
+};
+
+typedef enum {
+  DATA_ASCII,
+  DATA_LATIN1,
+  DATA_UTF8_LATIN,
+  DATA_UTF8_CJK,
+  DATASETS
+} DataSet;
+
+static const char *const data_names[DATASETS] = {
+  [DATA_ASCII]      = "ascii",
+  [DATA_LATIN1]     = "latin1",
+  [DATA_UTF8_LATIN] = "utf8_latin",
+  [DATA_UTF8_CJK]   = "utf8_cjk"
+};
+
+/* a sink for the results, so that the calls aren't optimised away */
+static volatile size_t sink;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Fill a buffer with text of a given kind
+ *
+ * The text is mostly ASCII words with some non-ASCII characters thrown
+ * in, which is what selections usually look like; the CJK data set has
+ * no ASCII at all.
+ */
+static size_t fill_data(DataSet set, char *buf, size_t size)
+{
+  static const char *const latin_words[] = {
+    "caf\xc3\xa9", "na\xc3\xafve", "stra\xc3\x9f" "e", "se\xc3\xb1or", "\xc3\xa5r"
+  };
+  static const char cjk[] = "\xe6\x96\x87\xe5\xad\x97\xe5\x88\x97";
+  size_t len = 0;
+  unsigned seed = 1;
+
+  while ( len < size - 16 ) {
+    seed = seed * 1103515245 + 12345;
+
+    switch(set) {
+    case DATA_ASCII:
+      buf[len++] = 'a' + (seed >> 16) % 26;
+      if ( (seed >> 8) % 7 == 0 ) buf[len++] = ' ';
+      break;
+    case DATA_LATIN1:
+      buf[len++] = (seed >> 16) % 20 == 0 ? 0xE0 + (seed >> 8) % 32 : 'a' + (seed >> 16) % 26;
+      break;
+    case DATA_UTF8_LATIN:
+      if ( (seed >> 16) % 20 == 0 ) {
+	const char *word = latin_words[(seed >> 8) % 5];
+	memcpy(buf + len, word, strlen(word));
+	len += strlen(word);
+      } else
+	buf[len++] = 'a' + (seed >> 16) % 26;
+      break;
+    case DATA_UTF8_CJK:
+      memcpy(buf + len, cjk + 3 * ((seed >> 16) % 3), 3);
+      len += 3;
+      break;
+    case DATASETS:
+      break;
+    }
+  }
+
+  return len;
+}
+
+/**
+ * @brief Run a kernel over the data enough times to time it
+ * @return Throughput in GB/s, or 0 if the kernel doesn't apply
+ */
+static double run_kernel(Kernel kernel, DataSet set, const char *data,
+			 size_t len, char *out)
+{
+  /* UTF-8 conversions only take well-formed input, and the checks
+   * stop at the first byte that fails them
+   */
+  if ( set == DATA_LATIN1 &&
+       (kernel == KERNEL_UTF8_TO_LATIN1 || kernel == KERNEL_IS_UTF8) )
+    return 0;
+  if ( set != DATA_ASCII && kernel == KERNEL_IS_ASCII )
+    return 0;
+
+  double best = 0;
+  for (int run = 0; run < 5; run++) {
+    const double start = now();
+    bool lossless;
+
+    switch(kernel) {
+    case KERNEL_IS_ASCII:
+      sink += text_is_ascii(data, len);
+      break;
+    case KERNEL_IS_UTF8:
+      sink += text_is_utf8(data, len);
+      break;
+    case KERNEL_LATIN1_TO_UTF8:
+      sink += latin1_to_utf8(data, len, out);
+      break;
+    case KERNEL_UTF8_TO_LATIN1:
+      sink += utf8_to_latin1(data, len, out, &lossless);
+      break;
+    case KERNELS:
+      break;
+    }
+
+    const double rate = len / (now() - start) / 1e9;
+    if ( rate > best )
+      best = rate;
+  }
+
+  return best;
+}
+
+int main(int argc, char *argv[])
+{
+  size_t size = 16 << 20;
+  if ( argc > 1 )
+    size = strtoul(argv[1], NULL, 0);
+  if ( size < 64 )
+    size = 64;
+
+  char *data = malloc(size), *out = malloc(size * 2);
+  if ( data == NULL || out == NULL ) {
+    perror(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  for (DataSet set = 0; set < DATASETS; set++) {
+    const size_t len = fill_data(set, data, size);
+
+    for (Kernel kernel = 0; kernel < KERNELS; kernel++) {
+      double scalar = 0;
+
+      for (XcbClipSimdLevel level = 0; level < XCBCLIP_SIMD_LEVELS; level++) {
+	if ( !convert_set_simd_level(level) )
+	  continue;
+
+	const double rate = run_kernel(kernel, set, data, len, out);
+	if ( rate == 0 )
+	  continue;
+	if ( level == XCBCLIP_SIMD_SCALAR )
+	  scalar = rate;
+
+	printf("{\"kernel\":\"%s\",\"impl\":\"%s\",\"data\":\"%s\","
+	       "\"size\":%zu,\"gb_s\":%.3f,\"speedup\":%.2f}\n",
+	       kernel_names[kernel], convert_simd_name(level),
+	       data_names[set], len, rate, scalar ? rate / scalar : 1.0);
+      }
+    }
+  }
+
+  free(data);
+  free(out);
+  return EXIT_SUCCESS;
+}
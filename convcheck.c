@@ -0,0 +1,245 @@
+/*
+ *  convcheck.c - check the SIMD text kernels against the scalar ones
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Runs every conversion kernel the CPU supports over the same kinds of
+ * text as convbench, cut at every length around the 16 and 32 bytes
+ * blocks of the SIMD kernels, and with invalid and truncated sequences
+ * put at every position around the edges of the blocks; every result
+ * has to match the scalar implementation's. Prints the mismatches and
+ * exits with a failure if there is any.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xcbclip.h"
+
+/** Length of the texts the kernels are run over */
+#define CHECK_SIZE 200
+
+typedef enum {
+  DATA_ASCII,
+  DATA_LATIN1,
+  DATA_UTF8_LATIN,
+  DATA_UTF8_CJK,
+  DATA_UTF8_MIXED,
+  DATASETS
+} DataSet;
+
+static const char *const data_names[DATASETS] = {
+  [DATA_ASCII]      = "ascii",
+  [DATA_LATIN1]     = "latin1",
+  [DATA_UTF8_LATIN] = "utf8_latin",
+  [DATA_UTF8_CJK]   = "utf8_cjk",
+  [DATA_UTF8_MIXED] = "utf8_mixed"
+};
+
+/** Sequences that aren't well-formed UTF-8, or are cut short */
+static const char *const bad_sequences[] = {
+  "\x80",                /* stray continuation byte */
+  "\xbf\x80",
+  "\xc3",                /* truncated two bytes sequence */
+  "\xe6\x96",            /* truncated three bytes sequence */
+  "\xf0\x9f\x98",        /* truncated four bytes sequence */
+  "\xc0\x80",            /* overlong NUL */
+  "\xc1\xbf",
+  "\xe0\x80\x80",        /* overlong three bytes sequence */
+  "\xf0\x80\x80\x80",    /* overlong four bytes sequence */
+  "\xed\xa0\x80",        /* surrogate */
+  "\xf4\x90\x80\x80",    /* past U+10FFFF */
+  "\xf8\x88\x80\x80\x80",
+  "\xff",
+  "\xc3\x41"             /* continuation byte missing */
+};
+
+static unsigned int failures = 0;
+
+/**
+ * @brief Fill a buffer with text of a given kind
+ *
+ * The UTF-8 data sets only ever hold whole characters, but of every
+ * length, so that blocks end in the middle of some of them.
+ */
+static size_t fill_data(DataSet set, char *buf, size_t size)
+{
+  static const char *const latin_words[] = {
+    "caf\xc3\xa9", "na\xc3\xafve", "stra\xc3\x9f" "e", "se\xc3\xb1or", "\xc3\xa5r"
+  };
+  static const char *const mixed[] = {
+    "a", "\xc3\xa9", "\xe6\x96\x87", "\xf0\x9f\x98\x80", "\xc2\x80", "\xef\xbf\xbd"
+  };
+  static const char cjk[] = "\xe6\x96\x87\xe5\xad\x97\xe5\x88\x97";
+  size_t len = 0;
+  unsigned seed = 1;
+
+  while ( len < size - 8 ) {
+    seed = seed * 1103515245 + 12345;
+
+    switch(set) {
+    case DATA_ASCII:
+      buf[len++] = 'a' + (seed >> 16) % 26;
+      break;
+    case DATA_LATIN1:
+      buf[len++] = (seed >> 16) % 5 == 0 ? 0xA0 + (seed >> 8) % 96 : 'a' + (seed >> 16) % 26;
+      break;
+    case DATA_UTF8_LATIN:
+      if ( (seed >> 16) % 5 == 0 ) {
+	const char *word = latin_words[(seed >> 8) % 5];
+	memcpy(buf + len, word, strlen(word));
+	len += strlen(word);
+      } else
+	buf[len++] = 'a' + (seed >> 16) % 26;
+      break;
+    case DATA_UTF8_CJK:
+      memcpy(buf + len, cjk + 3 * ((seed >> 16) % 3), 3);
+      len += 3;
+      break;
+    case DATA_UTF8_MIXED: {
+      const char *c = mixed[(seed >> 16) % 6];
+      memcpy(buf + len, c, strlen(c));
+      len += strlen(c);
+      break;
+    }
+    case DATASETS:
+      break;
+    }
+  }
+
+  return len;
+}
+
+/**
+ * @brief Run every kernel on a text, and compare each implementation
+ *        with the scalar one
+ * @param valid Whether the text is well-formed UTF-8, which
+ *        utf8_to_latin1() needs
+ */
+static void check_text(const char *what, size_t pos, const char *data,
+		       size_t len, bool valid)
+{
+  static char expected[CHECK_SIZE * 2], out[CHECK_SIZE * 2];
+
+  convert_set_simd_level(XCBCLIP_SIMD_SCALAR);
+  const bool ascii = text_is_ascii(data, len);
+  const bool utf8 = text_is_utf8(data, len);
+  const size_t latin1_len = latin1_to_utf8(data, len, expected);
+
+  if ( valid && !utf8 ) {
+    fprintf(stderr, "%s, length %zu: scalar is_utf8 rejects valid text\n",
+	    what, len);
+    failures++;
+  }
+
+  for (XcbClipSimdLevel level = XCBCLIP_SIMD_SCALAR + 1;
+       level < XCBCLIP_SIMD_LEVELS; level++) {
+    if ( !convert_set_simd_level(level) )
+      continue;
+
+    const char *const impl = convert_simd_name(level);
+    const char *failed = NULL;
+
+    if ( text_is_ascii(data, len) != ascii )
+      failed = "is_ascii";
+    else if ( text_is_utf8(data, len) != utf8 )
+      failed = "is_utf8";
+    else if ( latin1_to_utf8(data, len, out) != latin1_len ||
+	      memcmp(out, expected, latin1_len) != 0 )
+      failed = "latin1_to_utf8";
+
+    if ( failed != NULL ) {
+      fprintf(stderr, "%s: %s differs on %s at %zu, length %zu\n",
+	      impl, failed, what, pos, len);
+      failures++;
+    }
+  }
+
+  if ( !valid )
+    return;
+
+  bool lossless_expected, lossless;
+  convert_set_simd_level(XCBCLIP_SIMD_SCALAR);
+  const size_t utf8_len = utf8_to_latin1(data, len, expected, &lossless_expected);
+
+  for (XcbClipSimdLevel level = XCBCLIP_SIMD_SCALAR + 1;
+       level < XCBCLIP_SIMD_LEVELS; level++) {
+    if ( !convert_set_simd_level(level) )
+      continue;
+
+    if ( utf8_to_latin1(data, len, out, &lossless) != utf8_len ||
+	 lossless != lossless_expected || memcmp(out, expected, utf8_len) != 0 ) {
+      fprintf(stderr, "%s: utf8_to_latin1 differs on %s, length %zu\n",
+	      convert_simd_name(level), what, len);
+      failures++;
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  static char data[CHECK_SIZE], text[CHECK_SIZE];
+
+  for (DataSet set = 0; set < DATASETS; set++) {
+    const size_t len = fill_data(set, data, sizeof(data));
+    const bool is_utf8 = set != DATA_LATIN1;
+
+    /* every length, which cuts characters short at every block edge;
+     * only the lengths ending on a character boundary are valid
+     */
+    for (size_t cut = 0; cut <= len; cut++) {
+      convert_set_simd_level(XCBCLIP_SIMD_SCALAR);
+      const bool valid = is_utf8 && text_is_utf8(data, cut) &&
+	(cut == len || ((unsigned char)data[cut] & 0xC0) != 0x80);
+      check_text(data_names[set], 0, data, cut, valid);
+    }
+
+    /* every bad sequence, at every position from just before the end of
+     * a block to just after the start of the next
+     */
+    for (size_t b = 0; b < sizeof(bad_sequences) / sizeof(*bad_sequences); b++) {
+      const size_t bad_len = strlen(bad_sequences[b]);
+
+      for (size_t pos = 0; pos + bad_len <= len; pos++) {
+	if ( pos % 16 > 4 && pos % 16 < 11 )
+	  continue;
+
+	memcpy(text, data, len);
+	memcpy(text + pos, bad_sequences[b], bad_len);
+	check_text(data_names[set], pos, text, len, false);
+
+	/* and with the text ending right on the bad sequence */
+	check_text(data_names[set], pos, text, pos + bad_len, false);
+      }
+    }
+  }
+
+  if ( failures ) {
+    fprintf(stderr, "%s: %u mismatches\n", argv[0], failures);
+    return EXIT_FAILURE;
+  }
+
+  for (XcbClipSimdLevel level = 0; level < XCBCLIP_SIMD_LEVELS; level++)
+    if ( convert_simd_supported(level) )
+      printf("%s: all kernels match scalar\n", convert_simd_name(level));
+
+  return EXIT_SUCCESS;
+}
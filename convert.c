@@ -0,0 +1,663 @@
+/*
+ *  convert.c - text encoding checks and conversions for selection data
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "xcbclip.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define XCBCLIP_X86_KERNELS 1
+# include <immintrin.h>
+#endif
+
+/* Scalar kernels, always available and used for the tails of the
+ * vectorised ones.
+ */
+
+/**
+ * @brief Length of the UTF-8 sequence starting at p, if well-formed
+ * @param p Start of the sequence
+ * @param len Bytes available from p
+ * @return The length of the sequence, or 0 if it's not well-formed
+ *
+ * Overlong forms, surrogates and code points past U+10FFFF are
+ * rejected, as per RFC 3629.
+ */
+static size_t utf8_sequence(const unsigned char *p, size_t len)
+{
+  const unsigned char c = p[0];
+
+  if ( c < 0x80 )
+    return 1;
+
+  size_t n;
+  unsigned char lo = 0x80, hi = 0xBF;	/* range of the second byte */
+  if ( c >= 0xC2 && c <= 0xDF )
+    n = 1;
+  else if ( c >= 0xE0 && c <= 0xEF ) {
+    n = 2;
+    if ( c == 0xE0 ) lo = 0xA0;
+    if ( c == 0xED ) hi = 0x9F;
+  } else if ( c >= 0xF0 && c <= 0xF4 ) {
+    n = 3;
+    if ( c == 0xF0 ) lo = 0x90;
+    if ( c == 0xF4 ) hi = 0x8F;
+  } else
+    return 0;
+
+  if ( len <= n )
+    return 0;
+
+  if ( p[1] < lo || p[1] > hi )
+    return 0;
+  for (size_t k = 2; k <= n; k++)
+    if ( (p[k] & 0xC0) != 0x80 )
+      return 0;
+
+  return n + 1;
+}
+
+/**
+ * @brief Convert one ISO-8859-1 character to UTF-8
+ * @return The number of bytes written to q
+ */
+static inline size_t latin1_char_to_utf8(unsigned char c, unsigned char *q)
+{
+  if ( c < 0x80 ) {
+    q[0] = c;
+    return 1;
+  }
+
+  q[0] = 0xC0 | (c >> 6);
+  q[1] = 0x80 | (c & 0x3F);
+  return 2;
+}
+
+/**
+ * @brief Convert one UTF-8 character to ISO-8859-1
+ * @param p Start of the character, already validated
+ * @param len Bytes available from p
+ * @param q Where to write the character
+ * @param lossless Cleared if the character has no ISO-8859-1 equivalent
+ * @return The number of bytes consumed from p
+ */
+static inline size_t utf8_char_to_latin1(const unsigned char *p, size_t len,
+					 unsigned char *q, bool *lossless)
+{
+  const unsigned char c = p[0];
+
+  if ( c < 0x80 ) {
+    *q = c;
+    return 1;
+  }
+
+  if ( c < 0xC4 && len > 1 ) {
+    /* U+0080 to U+00FF */
+    *q = ((c & 0x1F) << 6) | (p[1] & 0x3F);
+    return 2;
+  }
+
+  *q = '?';
+  *lossless = false;
+  return c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+}
+
+static bool is_ascii_scalar(const char *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+
+  for (size_t i = 0; i < len; i++)
+    if ( p[i] & 0x80 )
+      return false;
+
+  return true;
+}
+
+static bool is_utf8_scalar(const char *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+
+  for (size_t i = 0, n; i < len; i += n)
+    if ( (n = utf8_sequence(p + i, len - i)) == 0 )
+      return false;
+
+  return true;
+}
+
+static size_t latin1_to_utf8_scalar(const char *in, size_t len, char *out)
+{
+  const unsigned char *p = (const unsigned char *)in;
+  unsigned char *q = (unsigned char *)out;
+
+  for (size_t i = 0; i < len; i++)
+    q += latin1_char_to_utf8(p[i], q);
+
+  return q - (unsigned char *)out;
+}
+
+static size_t utf8_to_latin1_scalar(const char *in, size_t len, char *out,
+				    bool *lossless)
+{
+  const unsigned char *p = (const unsigned char *)in;
+  unsigned char *q = (unsigned char *)out;
+
+  *lossless = true;
+
+  for (size_t i = 0; i < len; q++)
+    i += utf8_char_to_latin1(p + i, len - i, q, lossless);
+
+  return q - (unsigned char *)out;
+}
+
+#ifdef XCBCLIP_X86_KERNELS
+
+/* SSE2 kernels: whole 16-byte blocks of ASCII are checked and copied at
+ * once, everything else goes through the scalar code one character at
+ * a time.
+ */
+
+__attribute__((target("sse2")))
+static inline bool block_is_ascii_sse2(const unsigned char *p)
+{
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p)) == 0;
+}
+
+__attribute__((target("sse2")))
+static bool is_ascii_sse2(const char *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  size_t i = 0;
+
+  /* OR four blocks together before checking the sign bits */
+  for (; i + 64 <= len; i += 64) {
+    const __m128i v = _mm_or_si128(
+      _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)),
+		   _mm_loadu_si128((const __m128i *)(p + i + 16))),
+      _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+		   _mm_loadu_si128((const __m128i *)(p + i + 48))));
+    if ( _mm_movemask_epi8(v) )
+      return false;
+  }
+
+  for (; i + 16 <= len; i += 16)
+    if ( !block_is_ascii_sse2(p + i) )
+      return false;
+
+  return is_ascii_scalar(buf + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static bool is_utf8_sse2(const char *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  size_t i = 0;
+
+  while ( i < len ) {
+    if ( i + 16 <= len && block_is_ascii_sse2(p + i) ) {
+      i += 16;
+      continue;
+    }
+
+    /* validate the rest of the block one sequence at a time */
+    const size_t end = i + 16;
+    while ( i < end && i < len ) {
+      const size_t n = utf8_sequence(p + i, len - i);
+      if ( n == 0 )
+	return false;
+      i += n;
+    }
+  }
+
+  return true;
+}
+
+__attribute__((target("sse2")))
+static size_t latin1_to_utf8_sse2(const char *in, size_t len, char *out)
+{
+  const unsigned char *p = (const unsigned char *)in;
+  unsigned char *q = (unsigned char *)out;
+  size_t i = 0;
+
+  while ( i + 16 <= len ) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+
+    if ( _mm_movemask_epi8(v) == 0 ) {
+      _mm_storeu_si128((__m128i *)q, v);
+      q += 16; i += 16;
+      continue;
+    }
+
+    /* convert blocks with some non-ASCII character one at a time */
+    for (const size_t end = i + 16; i < end; i++)
+      q += latin1_char_to_utf8(p[i], q);
+  }
+
+  for (; i < len; i++)
+    q += latin1_char_to_utf8(p[i], q);
+
+  return q - (unsigned char *)out;
+}
+
+__attribute__((target("sse2")))
+static size_t utf8_to_latin1_sse2(const char *in, size_t len, char *out,
+				  bool *lossless)
+{
+  const unsigned char *p = (const unsigned char *)in;
+  unsigned char *q = (unsigned char *)out;
+  size_t i = 0;
+
+  *lossless = true;
+
+  while ( i + 16 <= len ) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+
+    if ( _mm_movemask_epi8(v) == 0 ) {
+      _mm_storeu_si128((__m128i *)q, v);
+      q += 16; i += 16;
+      continue;
+    }
+
+    /* the last sequence of the block might end past it */
+    for (const size_t end = i + 16; i < end && i < len; q++)
+      i += utf8_char_to_latin1(p + i, len - i, q, lossless);
+  }
+
+  while ( i < len )
+    i += utf8_char_to_latin1(p + i, len - i, q++, lossless);
+
+  return q - (unsigned char *)out;
+}
+
+/* AVX2 kernels. UTF-8 validation uses the lookup algorithm by Keiser
+ * and Lemire ("Validating UTF-8 In Less Than One Instruction Per Byte",
+ * 2021): the error classes of every two-byte window are looked up by
+ * nibble with three shuffles and ANDed together, and the continuation
+ * bytes required by three and four byte sequences are checked
+ * separately. The conversions copy 32-byte ASCII blocks at once.
+ */
+
+#define UTF8_TOO_SHORT      (1 << 0)
+#define UTF8_TOO_LONG       (1 << 1)
+#define UTF8_OVERLONG_3     (1 << 2)
+#define UTF8_TOO_LARGE      (1 << 3)
+#define UTF8_SURROGATE      (1 << 4)
+#define UTF8_OVERLONG_2     (1 << 5)
+#define UTF8_TOO_LARGE_1000 (1 << 6)
+#define UTF8_OVERLONG_4     (1 << 6)
+#define UTF8_TWO_CONTS      (1 << 7)
+#define UTF8_CARRY          (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+#define BROADCAST16(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+__attribute__((target("avx2")))
+static inline __m256i high_nibbles_avx2(__m256i v)
+{
+  return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+}
+
+/** The input shifted by n bytes, with the end of the previous block */
+#define PREV_AVX2(input, prev_input, n)					\
+  _mm256_alignr_epi8(input,						\
+		     _mm256_permute2x128_si256(prev_input, input, 0x21), \
+		     16 - (n))
+
+__attribute__((target("avx2")))
+static inline __m256i utf8_block_errors_avx2(__m256i input, __m256i prev_input)
+{
+  const __m256i byte_1_high_table = BROADCAST16(
+    /* 0_______ : ASCII */
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    /* 10______ : continuation */
+    UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+    /* 1100____ : two byte lead */
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+    /* 1101____ : two byte lead */
+    UTF8_TOO_SHORT,
+    /* 1110____ : three byte lead */
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+    /* 1111____ : four byte lead */
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4);
+
+  const __m256i byte_1_low_table = BROADCAST16(
+    /* ____0000 */
+    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+    /* ____0001 */
+    UTF8_CARRY | UTF8_OVERLONG_2,
+    /* ____001_ */
+    UTF8_CARRY,
+    UTF8_CARRY,
+    /* ____0100 */
+    UTF8_CARRY | UTF8_TOO_LARGE,
+    /* ____0101 to ____1100 */
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    /* ____1101 */
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+    /* ____111_ */
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000);
+
+  const __m256i byte_2_high_table = BROADCAST16(
+    /* 0_______ : ASCII */
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    /* 1000____ */
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+    UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+    /* 1001____ */
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+    UTF8_TOO_LARGE,
+    /* 101_____ */
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+    UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+    UTF8_TOO_LARGE,
+    /* 11______ : lead */
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+
+  const __m256i prev1 = PREV_AVX2(input, prev_input, 1);
+
+  const __m256i special_cases = _mm256_and_si256(
+    _mm256_and_si256(
+      _mm256_shuffle_epi8(byte_1_high_table, high_nibbles_avx2(prev1)),
+      _mm256_shuffle_epi8(byte_1_low_table,
+			  _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)))),
+    _mm256_shuffle_epi8(byte_2_high_table, high_nibbles_avx2(input)));
+
+  /* the third and fourth bytes of a sequence must be continuations */
+  const __m256i prev2 = PREV_AVX2(input, prev_input, 2);
+  const __m256i prev3 = PREV_AVX2(input, prev_input, 3);
+  const __m256i is_third_byte = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80));
+  const __m256i is_fourth_byte = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80));
+  const __m256i must_be_cont = _mm256_and_si256(
+    _mm256_or_si256(is_third_byte, is_fourth_byte), _mm256_set1_epi8(0x80));
+
+  return _mm256_xor_si256(must_be_cont, special_cases);
+}
+
+/** Non-zero where a block ends in the middle of a sequence */
+__attribute__((target("avx2")))
+static inline __m256i utf8_block_incomplete_avx2(__m256i input)
+{
+  const __m256i max_value = _mm256_setr_epi8(
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    0xF0 - 1, 0xE0 - 1, 0xC0 - 1);
+
+  return _mm256_subs_epu8(input, max_value);
+}
+
+__attribute__((target("avx2")))
+static bool is_ascii_avx2(const char *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  size_t i = 0;
+
+  for (; i + 128 <= len; i += 128) {
+    const __m256i v = _mm256_or_si256(
+      _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + i)),
+		      _mm256_loadu_si256((const __m256i *)(p + i + 32))),
+      _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + i + 64)),
+		      _mm256_loadu_si256((const __m256i *)(p + i + 96))));
+    if ( _mm256_movemask_epi8(v) )
+      return false;
+  }
+
+  for (; i + 32 <= len; i += 32)
+    if ( _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(p + i))) )
+      return false;
+
+  return is_ascii_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static bool is_utf8_avx2(const char *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  __m256i error = _mm256_setzero_si256();
+  __m256i prev_input = _mm256_setzero_si256();
+  __m256i prev_incomplete = _mm256_setzero_si256();
+  size_t i = 0;
+
+  for (;; i += 32) {
+    __m256i input;
+
+    if ( i + 32 <= len )
+      input = _mm256_loadu_si256((const __m256i *)(p + i));
+    else if ( i < len ) {
+      /* pad the tail with ASCII NULs */
+      unsigned char tail[32] = { 0 };
+      memcpy(tail, p + i, len - i);
+      input = _mm256_loadu_si256((const __m256i *)tail);
+    } else
+      break;
+
+    if ( _mm256_movemask_epi8(input) == 0 ) {
+      /* an ASCII block only needs the previous one to be complete */
+      error = _mm256_or_si256(error, prev_incomplete);
+    } else {
+      error = _mm256_or_si256(error, utf8_block_errors_avx2(input, prev_input));
+      prev_incomplete = utf8_block_incomplete_avx2(input);
+    }
+
+    prev_input = input;
+
+    /* bail out early on invalid data */
+    if ( (i & 0xFFF) == 0 && !_mm256_testz_si256(error, error) )
+      return false;
+  }
+
+  error = _mm256_or_si256(error, prev_incomplete);
+  return _mm256_testz_si256(error, error);
+}
+
+__attribute__((target("avx2")))
+static size_t latin1_to_utf8_avx2(const char *in, size_t len, char *out)
+{
+  const unsigned char *p = (const unsigned char *)in;
+  unsigned char *q = (unsigned char *)out;
+  size_t i = 0;
+
+  while ( i + 32 <= len ) {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+
+    if ( _mm256_movemask_epi8(v) == 0 ) {
+      _mm256_storeu_si256((__m256i *)q, v);
+      q += 32; i += 32;
+      continue;
+    }
+
+    /* convert blocks with some non-ASCII character one at a time */
+    for (const size_t end = i + 32; i < end; i++)
+      q += latin1_char_to_utf8(p[i], q);
+  }
+
+  for (; i < len; i++)
+    q += latin1_char_to_utf8(p[i], q);
+
+  return q - (unsigned char *)out;
+}
+
+__attribute__((target("avx2")))
+static size_t utf8_to_latin1_avx2(const char *in, size_t len, char *out,
+				  bool *lossless)
+{
+  const unsigned char *p = (const unsigned char *)in;
+  unsigned char *q = (unsigned char *)out;
+  size_t i = 0;
+
+  *lossless = true;
+
+  while ( i + 32 <= len ) {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+
+    if ( _mm256_movemask_epi8(v) == 0 ) {
+      _mm256_storeu_si256((__m256i *)q, v);
+      q += 32; i += 32;
+      continue;
+    }
+
+    /* the last sequence of the block might end past it */
+    for (const size_t end = i + 32; i < end && i < len; q++)
+      i += utf8_char_to_latin1(p + i, len - i, q, lossless);
+  }
+
+  while ( i < len )
+    i += utf8_char_to_latin1(p + i, len - i, q++, lossless);
+
+  return q - (unsigned char *)out;
+}
+
+#endif /* XCBCLIP_X86_KERNELS */
+
+/** A set of kernels for one instruction set */
+typedef struct {
+  const char *name;
+  bool (*is_ascii)(const char *buf, size_t len);
+  bool (*is_utf8)(const char *buf, size_t len);
+  size_t (*latin1_to_utf8)(const char *in, size_t len, char *out);
+  size_t (*utf8_to_latin1)(const char *in, size_t len, char *out, bool *lossless);
+} XcbClipKernels;
+
+static const XcbClipKernels kernels_table[XCBCLIP_SIMD_LEVELS] = {
+  [XCBCLIP_SIMD_SCALAR] = { "scalar", is_ascii_scalar, is_utf8_scalar,
+			    latin1_to_utf8_scalar, utf8_to_latin1_scalar },
+#ifdef XCBCLIP_X86_KERNELS
+  [XCBCLIP_SIMD_SSE2] = { "sse2", is_ascii_sse2, is_utf8_sse2,
+			  latin1_to_utf8_sse2, utf8_to_latin1_sse2 },
+  [XCBCLIP_SIMD_AVX2] = { "avx2", is_ascii_avx2, is_utf8_avx2,
+			  latin1_to_utf8_avx2, utf8_to_latin1_avx2 },
+#endif
+};
+
+/** Kernels in use, chosen on first use */
+static const XcbClipKernels *kernels = NULL;
+
+/**
+ * @brief Check whether the CPU can run a set of kernels
+ */
+bool convert_simd_supported(XcbClipSimdLevel level)
+{
+  if ( level >= XCBCLIP_SIMD_LEVELS || kernels_table[level].name == NULL )
+    return false;
+
+#ifdef XCBCLIP_X86_KERNELS
+  __builtin_cpu_init();
+  if ( level == XCBCLIP_SIMD_SSE2 )
+    return __builtin_cpu_supports("sse2");
+  if ( level == XCBCLIP_SIMD_AVX2 )
+    return __builtin_cpu_supports("avx2");
+#endif
+
+  return true;
+}
+
+/**
+ * @brief Force the kernels to use
+ * @return false if the CPU can't run them
+ */
+bool convert_set_simd_level(XcbClipSimdLevel level)
+{
+  if ( !convert_simd_supported(level) )
+    return false;
+
+  kernels = &kernels_table[level];
+  return true;
+}
+
+/**
+ * @brief Name of a set of kernels, for diagnostics and benchmarks
+ */
+const char *convert_simd_name(XcbClipSimdLevel level)
+{
+  return level < XCBCLIP_SIMD_LEVELS ? kernels_table[level].name : NULL;
+}
+
+/**
+ * @brief The kernels in use, picking the best the CPU supports
+ */
+static const XcbClipKernels *get_kernels()
+{
+  if ( kernels == NULL ) {
+    XcbClipSimdLevel level = XCBCLIP_SIMD_LEVELS;
+    while ( level-- > XCBCLIP_SIMD_SCALAR )
+      if ( convert_set_simd_level(level) )
+	break;
+  }
+
+  return kernels;
+}
+
+/**
+ * @brief Check whether a buffer only contains 7-bit ASCII
+ */
+bool text_is_ascii(const char *buf, size_t len)
+{
+  return get_kernels()->is_ascii(buf, len);
+}
+
+/**
+ * @brief Check whether a buffer is well-formed UTF-8
+ *
+ * Overlong forms, surrogates and code points past U+10FFFF are
+ * rejected, as per RFC 3629.
+ */
+bool text_is_utf8(const char *buf, size_t len)
+{
+  return get_kernels()->is_utf8(buf, len);
+}
+
+/**
+ * @brief Convert ISO-8859-1 text to UTF-8
+ * @param in Text to convert
+ * @param len Length of in
+ * @param out Buffer for the result, at least twice len in size
+ * @return Length of the converted text
+ */
+size_t latin1_to_utf8(const char *in, size_t len, char *out)
+{
+  return get_kernels()->latin1_to_utf8(in, len, out);
+}
+
+/**
+ * @brief Convert well-formed UTF-8 text to ISO-8859-1
+ * @param in Text to convert, as validated by text_is_utf8()
+ * @param len Length of in
+ * @param out Buffer for the result, at least len in size
+ * @param lossless Set to false if some character had no ISO-8859-1
+ *        equivalent and was replaced by a question mark
+ * @return Length of the converted text
+ */
+size_t utf8_to_latin1(const char *in, size_t len, char *out, bool *lossless)
+{
+  return get_kernels()->utf8_to_latin1(in, len, out, lossless);
+}
@@ -0,0 +1,422 @@
+/*
+ *  daemon.c - handing selections over to a running xcbclip daemon
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "xcbclip.h"
+
+/* A client connects to the daemon's socket and sends a single
+ * XcbClipHandoff message; to hand a selection over, the file descriptor
+ * of the data is attached to it. The daemon answers with a single byte,
+ * zero on success, with the file descriptor of the entry attached when
+ * fetching from the history, and closes the connection.
+ */
+
+/** Magic number of the handoff message, changed with its layout */
+#define XC_HANDOFF_MAGIC 0x78636202
+
+/** Message sent by a client */
+typedef struct {
+  uint32_t magic;
+  uint32_t index;        /**< history entry to fetch, 0 being the newest */
+  uint8_t op;            /**< an XcbClipDaemonOp */
+  char selection;        /**< 'p', 's' or 'c', as given to --selection */
+} XcbClipHandoff;
+
+/** Path the daemon's socket was bound to, to remove it on exit */
+static char bound_path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+
+/**
+ * @brief Check, or create, the private directory of the /tmp fallback
+ * @param path Directory to check
+ * @param create Whether to create it if it's missing
+ * @return false if it's missing, or anyone but the user could have put
+ *         a socket in it
+ *
+ * Anyone can create files in /tmp, and the sticky bit prevents us from
+ * removing theirs, so the socket is never put there directly.
+ */
+static bool private_dir(const char *path, bool create)
+{
+  struct stat st;
+
+  if ( create && mkdir(path, 0700) != 0 && errno != EEXIST )
+    return false;
+
+  return lstat(path, &st) == 0 && S_ISDIR(st.st_mode) &&
+    st.st_uid == geteuid() && (st.st_mode & 0077) == 0;
+}
+
+/**
+ * @brief Find the path of the daemon socket for the display in use
+ * @param create Whether to create the directory the socket lives in
+ * @return false if there is no display to tell the path from, or no
+ *         directory safe to put the socket in
+ *
+ * The socket lives in the user's runtime directory when there is one,
+ * otherwise in a directory of /tmp only the user can write to, with the
+ * user ID in its name. The screen number is left out, since selections
+ * belong to the whole display.
+ */
+static bool socket_path(struct sockaddr_un *addr, bool create)
+{
+  const char *display = sdisp ? sdisp : getenv("DISPLAY");
+  if ( display == NULL || *display == '\0' )
+    return false;
+
+  char name[64];
+  size_t len = 0;
+  const char *colon = strrchr(display, ':');
+  for (const char *p = display; *p && len < sizeof(name) - 1; p++) {
+    if ( colon && p > colon && *p == '.' )
+      break;
+    name[len++] = *p == '/' ? '_' : *p;
+  }
+  name[len] = '\0';
+
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  char tmp_dir[64];
+  if ( dir == NULL || *dir == '\0' ) {
+    snprintf(tmp_dir, sizeof(tmp_dir), "/tmp/xcbclip-%u", (unsigned)geteuid());
+    if ( !private_dir(tmp_dir, create) )
+      return false;
+    dir = tmp_dir;
+  }
+
+  const int res = snprintf(addr->sun_path, sizeof(addr->sun_path),
+			   "%s/xcbclip-%s", dir, name);
+
+  addr->sun_family = AF_UNIX;
+  return res > 0 && (size_t)res < sizeof(addr->sun_path);
+}
+
+/**
+ * @brief Connect to the daemon for the display in use
+ * @return The connected socket, or -1 if no daemon is running
+ *
+ * A socket that isn't the user's own daemon is never talked to: the
+ * data handed over, and the history entries read back, would go to and
+ * come from someone else.
+ */
+int daemon_connect()
+{
+  struct sockaddr_un addr;
+  if ( !socket_path(&addr, false) )
+    return -1;
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if ( sock < 0 )
+    return -1;
+
+  if ( connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ) {
+    close(sock);
+    return -1;
+  }
+
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  if ( getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+       cred.uid != geteuid() ) {
+    fprintf(stderr, "%s: %s is not your daemon's, ignored\n",
+	    progname, addr.sun_path);
+    close(sock);
+    return -1;
+  }
+#endif
+
+  return sock;
+}
+
+/**
+ * @brief Check for the socket of a daemon for the display in use
+ * @return false if there is none, so no daemon can be running
+ *
+ * Nothing is sent to the daemon; a socket left behind by one that died
+ * is only found out when connecting to it.
+ */
+bool daemon_socket_exists()
+{
+  struct sockaddr_un addr;
+  struct stat st;
+
+  return socket_path(&addr, false) && stat(addr.sun_path, &st) == 0 &&
+    S_ISSOCK(st.st_mode);
+}
+
+/**
+ * @brief Create the daemon socket and listen on it
+ * @return The listening socket
+ *
+ * A socket left behind by a daemon that died is replaced, but not one
+ * that still has a daemon answering.
+ */
+int daemon_listen()
+{
+  struct sockaddr_un addr;
+  if ( !socket_path(&addr, true) ) {
+    fprintf(stderr, "%s: no display to run the daemon for, or no private "
+	    "directory for its socket\n", progname);
+    exit(EXIT_FAILURE);
+  }
+
+  const int running = daemon_connect();
+  if ( running >= 0 ) {
+    close(running);
+    fprintf(stderr, "%s: a daemon is already listening on %s\n",
+	    progname, addr.sun_path);
+    exit(EXIT_FAILURE);
+  }
+  unlink(addr.sun_path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if ( sock < 0 ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  /* only the user can connect to the socket */
+  const mode_t mask = umask(0077);
+  if ( bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       listen(sock, 16) != 0 ) {
+    perrorf("%s: %s (%s)", progname, __FUNCTION__, addr.sun_path);
+    exit(EXIT_FAILURE);
+  }
+  umask(mask);
+
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+  strcpy(bound_path, addr.sun_path);
+  return sock;
+}
+
+/**
+ * @brief Remove the socket created by daemon_listen()
+ */
+void daemon_unlink()
+{
+  if ( bound_path[0] != '\0' )
+    unlink(bound_path);
+  bound_path[0] = '\0';
+}
+
+/**
+ * @brief Send a message with an optional file descriptor attached
+ */
+static bool send_with_fd(int sock, const void *buf, size_t len, int fd)
+{
+  struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+  union {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+  if ( fd >= 0 ) {
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+/**
+ * @brief Receive a message with an optional file descriptor attached
+ * @param fd Set to the file descriptor, or -1 if none was attached
+ * @return false if the message was cut short
+ */
+static bool recv_with_fd(int sock, void *buf, size_t len, int *fd)
+{
+  struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+  union {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  struct msghdr msg = {
+    .msg_iov = &iov, .msg_iovlen = 1,
+    .msg_control = control.buf, .msg_controllen = sizeof(control.buf)
+  };
+
+  *fd = -1;
+  const ssize_t rd = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+  struct cmsghdr *cmsg = rd > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if ( cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+       cmsg->cmsg_type == SCM_RIGHTS &&
+       cmsg->cmsg_len == CMSG_LEN(sizeof(int)) )
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+  if ( rd == (ssize_t)len )
+    return true;
+
+  if ( *fd >= 0 )
+    close(*fd);
+  *fd = -1;
+  return false;
+}
+
+/**
+ * @brief Hand a selection over to the daemon
+ * @param sock Socket connected by daemon_connect()
+ * @param selection Selection to take, as given to --selection
+ * @param fd File descriptor of the data, sealed against changes
+ * @return true once the daemon owns the selection
+ */
+bool daemon_send(int sock, char selection, int fd)
+{
+  const XcbClipHandoff handoff = {
+    .magic = XC_HANDOFF_MAGIC, .op = XCBCLIP_DAEMON_TAKE,
+    .selection = selection
+  };
+
+  if ( !send_with_fd(sock, &handoff, sizeof(handoff), fd) )
+    return false;
+
+  char status;
+  return read(sock, &status, 1) == 1 && status == 0;
+}
+
+/**
+ * @brief Fetch an entry of the daemon's history
+ * @param sock Socket connected by daemon_connect()
+ * @param index Entry to fetch, 0 being the newest
+ * @return A file descriptor to read the entry from, or -1 if the daemon
+ *         has no such entry
+ */
+int daemon_fetch(int sock, unsigned int index)
+{
+  const XcbClipHandoff handoff = {
+    .magic = XC_HANDOFF_MAGIC, .op = XCBCLIP_DAEMON_FETCH, .index = index
+  };
+
+  if ( !send_with_fd(sock, &handoff, sizeof(handoff), -1) )
+    return -1;
+
+  char status; int fd;
+  if ( !recv_with_fd(sock, &status, 1, &fd) )
+    return -1;
+
+  if ( status != 0 && fd >= 0 ) {
+    close(fd);
+    fd = -1;
+  }
+
+  return fd;
+}
+
+/**
+ * @brief Receive a request from a client
+ * @param sock Connection accepted on the daemon socket, once readable
+ * @param request Set to the request
+ * @return false if the request is not valid
+ *
+ * Only clients of the same user are accepted, and only with data that
+ * can't change, or shrink under the mapping, once received.
+ */
+bool daemon_receive(int sock, XcbClipDaemonRequest *request)
+{
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  if ( getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+       cred.uid != geteuid() )
+    return false;
+#endif
+
+  XcbClipHandoff handoff;
+  int fd;
+  if ( !recv_with_fd(sock, &handoff, sizeof(handoff), &fd) )
+    return false;
+
+  bool valid = handoff.magic == XC_HANDOFF_MAGIC;
+
+  switch(handoff.op) {
+  case XCBCLIP_DAEMON_TAKE:
+    valid = valid && fd >= 0 &&
+      (handoff.selection == 'p' || handoff.selection == 's' ||
+       handoff.selection == 'c');
+
+    /* the data is served from a mapping of the file for as long as the
+     * selection is held, so a file that can't be proven sealed could
+     * change, or shrink and kill the daemon, under it
+     */
+#ifdef F_GET_SEALS
+    if ( valid ) {
+      const int seals = fcntl(fd, F_GET_SEALS);
+      valid = seals >= 0 && (seals & F_SEAL_SHRINK) && (seals & F_SEAL_WRITE);
+    }
+#else
+    valid = false;
+#endif
+    break;
+  case XCBCLIP_DAEMON_FETCH:
+    valid = valid && fd < 0;
+    break;
+  default:
+    valid = false;
+  }
+
+  if ( !valid ) {
+    if ( fd >= 0 )
+      close(fd);
+    return false;
+  }
+
+  request->op = handoff.op;
+  request->selection = handoff.selection;
+  request->index = handoff.index;
+  request->fd = fd;
+  return true;
+}
+
+/**
+ * @brief Answer a client's request
+ * @param sock Connection the request came from
+ * @param ok Whether the request succeeded
+ * @param fd File descriptor to pass to the client, or -1
+ */
+void daemon_reply(int sock, bool ok, int fd)
+{
+  const char status = ok ? 0 : 1;
+  send_with_fd(sock, &status, 1, ok ? fd : -1);
+}
@@ -0,0 +1,196 @@
+/*
+ *  eventloop.c - waiting on the X connection and other sources at once
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "xcbclip.h"
+
+/* All the waiting is done in a single poll() on the X connection and on
+ * the file descriptors registered with loop_watch_fd(), whose handlers
+ * are called from within the wait. A deadline bounds the wait, so that
+ * an X client that stopped answering can't hold us forever.
+ */
+
+/** A file descriptor watched by the loop */
+typedef struct {
+  int fd;
+  short events;
+  XcbClipFdHandler handler;
+  void *arg;
+} LoopSource;
+
+/** Table of the watched file descriptors */
+static LoopSource *sources = NULL;
+static size_t sources_count = 0;
+static size_t sources_size = 0;
+
+/** Poll set, the X connection first and then the sources */
+static struct pollfd *pollfds = NULL;
+
+/**
+ * @brief Find the source of a file descriptor
+ * @return The source, or NULL if fd is not watched
+ */
+static LoopSource *find_source(int fd)
+{
+  for (size_t i = 0; i < sources_count; i++)
+    if ( sources[i].fd == fd )
+      return &sources[i];
+
+  return NULL;
+}
+
+/**
+ * @brief Watch a file descriptor while waiting for X events
+ * @param fd File descriptor to watch
+ * @param events poll() events to wait for
+ * @param handler Called from loop_wait() when fd is ready
+ * @param arg Passed to handler
+ *
+ * Watching a file descriptor again replaces its events and handler.
+ */
+void loop_watch_fd(int fd, short events, XcbClipFdHandler handler, void *arg)
+{
+  LoopSource *source = find_source(fd);
+
+  if ( source == NULL ) {
+    if ( sources_count == sources_size ) {
+      sources_size = sources_size ? sources_size * 2 : 4;
+      sources = realloc(sources, sources_size * sizeof(LoopSource));
+      pollfds = realloc(pollfds, (sources_size + 1) * sizeof(struct pollfd));
+      if ( sources == NULL || pollfds == NULL ) {
+	perrorf("%s: %s", progname, __FUNCTION__);
+	exit(EXIT_FAILURE);
+      }
+    }
+    source = &sources[sources_count++];
+  }
+
+  *source = (LoopSource){ fd, events, handler, arg };
+}
+
+/**
+ * @brief Stop watching a file descriptor
+ *
+ * Can be called from a handler, for its own file descriptor or another.
+ */
+void loop_unwatch_fd(int fd)
+{
+  LoopSource *source = find_source(fd);
+  if ( source != NULL )
+    *source = sources[--sources_count];
+}
+
+/**
+ * @brief Wait for the X connection or a watched file descriptor
+ * @param deadline Value of stats_now() to wait until at most, or 0 to
+ *        wait for as long as it takes
+ * @return false once the deadline has passed
+ *
+ * Anything queued for the server is sent first. The handlers of the
+ * ready file descriptors are called before returning; the X events
+ * are left for the caller to take with xcb_poll_for_event(). A signal
+ * ends the wait early, so that the caller can check its flags.
+ */
+bool loop_wait(double deadline)
+{
+  int timeout = -1;
+
+  if ( deadline > 0 ) {
+    const double left = deadline - stats_now();
+    if ( left <= 0 )
+      return false;
+
+    /* rounded up, not to wake up just short of the deadline */
+    timeout = left < INT_MAX / 1000 ? (int)(left * 1000) + 1 : INT_MAX;
+  }
+
+  /* the X connection has a slot even with no sources */
+  if ( pollfds == NULL && (pollfds = malloc(sizeof(struct pollfd))) == NULL ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  xcb_flush(xconn);
+
+  const size_t count = sources_count;
+  pollfds[0] = (struct pollfd){ .fd = xcb_get_file_descriptor(xconn), .events = POLLIN };
+  for (size_t i = 0; i < count; i++)
+    pollfds[i + 1] = (struct pollfd){ .fd = sources[i].fd, .events = sources[i].events };
+
+  const int res = poll(pollfds, count + 1, timeout);
+  if ( res < 0 ) {
+    if ( errno == EINTR )
+      return true;
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  if ( res == 0 )
+    return deadline == 0 || stats_now() < deadline;
+
+  /* handlers can change the table, so each source is looked up again */
+  for (size_t i = 0; i < count; i++) {
+    if ( pollfds[i + 1].revents == 0 )
+      continue;
+
+    const LoopSource *source = find_source(pollfds[i + 1].fd);
+    if ( source != NULL )
+      source->handler(source->fd, pollfds[i + 1].revents, source->arg);
+  }
+
+  return true;
+}
+
+/**
+ * @brief Wait for the next X event, up to a deadline
+ * @param deadline As for loop_wait()
+ * @return The event, to be freed by the caller, or NULL if the deadline
+ *         passed or the connection was lost
+ *
+ * Like xcb_wait_for_event(), but the watched file descriptors are
+ * served while waiting.
+ */
+xcb_generic_event_t *loop_wait_for_event(double deadline)
+{
+  xcb_generic_event_t *event;
+
+  while ( (event = xcb_poll_for_event(xconn)) == NULL ) {
+    if ( xcb_connection_has_error(xconn) || !loop_wait(deadline) )
+      return NULL;
+  }
+
+  return event;
+}
+
+/**
+ * @brief Deadline for the next step of a transfer, set with --timeout
+ * @return The deadline, or 0 if there is none
+ */
+double loop_deadline()
+{
+  return stimeout > 0 ? stats_now() + stimeout : 0;
+}
@@ -0,0 +1,250 @@
+/*
+ *  history.c - store of the selections served by the daemon
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "xcbclip.h"
+
+/* The entries live in a single arena, allocated once, used as a
+ * circular log: new entries are written after the newest one, and the
+ * oldest ones are evicted to make room. A selection copied again is
+ * moved to the head of the log, so the order of the log is also the
+ * order of last use and evicting from its tail is LRU.
+ *
+ * Memory use is bounded by the arena size, however many selections go
+ * through the store.
+ */
+
+/** An entry of the store */
+typedef struct {
+  size_t off;            /**< position of the data in the arena */
+  size_t len;            /**< length of the data */
+  uint64_t hash;         /**< hash of the data, to find copies */
+} HistoryEntry;
+
+static char *arena = NULL;
+static size_t arena_size = 0;
+/** Position in the arena the next entry is written to */
+static size_t arena_head = 0;
+
+/** Entries from the oldest to the newest, as a circular buffer */
+static HistoryEntry *entries = NULL;
+static unsigned int entries_size = 0;
+static unsigned int entries_first = 0;
+static unsigned int entries_count = 0;
+
+/**
+ * @brief Hash selection data
+ *
+ * FNV-1a over 64-bit words, rather than bytes, so that hashing is not
+ * much slower than copying; copies are confirmed with memcmp() anyway.
+ */
+static uint64_t hash_data(const char *data, size_t len)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * 0x100000001b3ULL;
+  }
+
+  for (; i < len; i++)
+    hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+
+  return hash ^ len;
+}
+
+/**
+ * @brief The n-th entry from the oldest
+ */
+static HistoryEntry *entry_at(unsigned int n)
+{
+  return &entries[(entries_first + n) % entries_size];
+}
+
+/**
+ * @brief Remove the n-th entry from the oldest
+ *
+ * Its space in the arena is reclaimed once the tail of the log gets
+ * past it.
+ */
+static void remove_entry(unsigned int n)
+{
+  for (unsigned int i = n; i > 0; i--)
+    *entry_at(i) = *entry_at(i - 1);
+
+  entries_first = (entries_first + 1) % entries_size;
+  entries_count--;
+}
+
+/**
+ * @brief Check whether an arena range overlaps any entry
+ */
+static bool range_in_use(size_t off, size_t len)
+{
+  for (unsigned int i = 0; i < entries_count; i++) {
+    const HistoryEntry *entry = entry_at(i);
+    if ( entry->len && off < entry->off + entry->len && entry->off < off + len )
+      return true;
+  }
+
+  return false;
+}
+
+/**
+ * @brief Set up the store
+ * @param count Number of entries to keep
+ * @param size Total size of the data to keep, in bytes
+ */
+void history_init(unsigned int count, size_t size)
+{
+  /* pages are only backed by memory once they are written to */
+  arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  entries = calloc(count, sizeof(HistoryEntry));
+  if ( arena == MAP_FAILED || entries == NULL ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  arena_size = size;
+  entries_size = count;
+  stats_buffer(size);
+}
+
+/**
+ * @brief Add a selection to the store, as the newest entry
+ *
+ * A selection already in the store is not stored twice, only moved to
+ * the head; the oldest entries are evicted when the store is full.
+ * Selections larger than the whole store are not kept at all.
+ */
+void history_add(const char *data, size_t len)
+{
+  if ( entries_size == 0 || len > arena_size )
+    return;
+
+  const uint64_t hash = hash_data(data, len);
+
+  for (unsigned int i = 0; i < entries_count; i++) {
+    const HistoryEntry *entry = entry_at(i);
+    if ( entry->hash != hash || entry->len != len ||
+	 memcmp(arena + entry->off, data, len) != 0 )
+      continue;
+
+    /* already the newest entry */
+    if ( i == entries_count - 1 )
+      return;
+
+    /* the data is written again at the head, from the copy at hand */
+    remove_entry(i);
+    break;
+  }
+
+  if ( entries_count == entries_size )
+    remove_entry(0);
+
+  /* write after the newest entry, or wrap around to the start of the
+   * arena, evicting whatever is in the way
+   */
+  size_t off = arena_head + len <= arena_size ? arena_head : 0;
+  while ( entries_count && range_in_use(off, len) ) {
+    remove_entry(0);
+    if ( entries_count == 0 )
+      off = 0;
+  }
+
+  memcpy(arena + off, data, len);
+  arena_head = off + len;
+
+  *entry_at(entries_count++) = (HistoryEntry){ off, len, hash };
+}
+
+/**
+ * @brief Get an entry of the store
+ * @param index Entry to get, 0 being the newest
+ * @param data Set to the data of the entry
+ * @param len Set to the length of the data
+ * @return false if there is no such entry
+ */
+bool history_get(unsigned int index, const char **data, size_t *len)
+{
+  if ( index >= entries_count )
+    return false;
+
+  const HistoryEntry *entry = entry_at(entries_count - 1 - index);
+  *data = arena + entry->off;
+  *len = entry->len;
+  return true;
+}
+
+/**
+ * @brief Open an entry of the store for a client to read
+ * @param index Entry to open, 0 being the newest
+ * @return A sealed memory file with a copy of the entry, or -1 if there
+ *         is no such entry, or it could not be copied and sealed
+ *
+ * The client gets a copy, since the entry can move or be evicted at any
+ * time after this returns.
+ */
+int history_open(unsigned int index)
+{
+#ifdef HAVE_MEMFD_CREATE
+  const char *data; size_t len;
+  if ( !history_get(index, &data, &len) )
+    return -1;
+
+  int fd = memfd_create("xcbclip-history", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if ( fd < 0 )
+    return -1;
+
+  /* the client shares the file offset, which has to stay at the start */
+  size_t done = 0;
+  while ( done < len ) {
+    const ssize_t wr = pwrite(fd, data + done, len - done, done);
+    if ( wr <= 0 ) {
+      close(fd);
+      return -1;
+    }
+    done += wr;
+  }
+
+  /* the client is told the entry can't change, so it must not */
+  if ( fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+	     F_SEAL_WRITE | F_SEAL_SEAL) != 0 ) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+#else
+  return -1;
+#endif
+}
@@ -0,0 +1,208 @@
+/*
+ *  input.c - reading many input files at once
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "xcbclip.h"
+
+/* The sizes of the files are known before reading any of them, so the
+ * buffer is allocated once, at its final size, and every file is read
+ * straight into its own place in it. The files are handed out to a few
+ * threads one at a time, so that a large file doesn't hold up the
+ * small ones behind it.
+ */
+
+/** Most threads to read files with */
+#define XC_READ_THREADS 8
+
+/** A file to read, and where it goes */
+typedef struct {
+  const char *path;
+  size_t off;            /**< position of the file in the buffer */
+  size_t len;            /**< size of the file, then bytes actually read */
+  int error;             /**< errno of a failed read, or 0 */
+  bool longer;           /**< there was more than its size to read */
+} XcbClipInputFile;
+
+/** Work shared by the reading threads */
+typedef struct {
+  XcbClipInputFile *files;
+  size_t count;
+  size_t next;           /**< next file to hand out */
+  pthread_mutex_t lock;
+  char *buf;
+} XcbClipReadJob;
+
+/**
+ * @brief Read a file into its place in the buffer
+ *
+ * A file that shrank since it was sized is read short. One that has
+ * more to read than its size, because it grew or because its size is
+ * made up as in procfs, is flagged so that it can be read again whole.
+ */
+static void read_file(XcbClipInputFile *file, char *buf)
+{
+  const int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+  if ( fd < 0 ) {
+    file->error = errno;
+    return;
+  }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, file->len, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  size_t done = 0;
+  while ( done < file->len ) {
+    const ssize_t rd = pread(fd, buf + file->off + done, file->len - done, done);
+    if ( rd < 0 && errno == EINTR )
+      continue;
+    if ( rd < 0 ) {
+      file->error = errno;
+      break;
+    }
+    if ( rd == 0 )
+      break;
+    done += rd;
+  }
+
+  char more;
+  file->longer = done == file->len && file->error == 0 &&
+    pread(fd, &more, 1, done) == 1;
+  file->len = done;
+  close(fd);
+}
+
+/**
+ * @brief Read the files of a job until none is left
+ */
+static void *read_files_thread(void *arg)
+{
+  XcbClipReadJob *job = arg;
+
+  while (true) {
+    pthread_mutex_lock(&job->lock);
+    const size_t i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+
+    if ( i >= job->count )
+      return NULL;
+
+    read_file(&job->files[i], job->buf);
+  }
+}
+
+/**
+ * @brief Read a set of regular files, concatenated, into a single buffer
+ * @param paths Files to read, in order
+ * @param count Number of files
+ * @param len Set to the length of the data read
+ * @return The data, allocated by the store, or NULL if any of the
+ *         files is not a regular file, or has a size that can't be
+ *         trusted, and has to be read as a stream
+ */
+char *read_files(char *const *paths, int count, size_t *len)
+{
+  XcbClipInputFile *files = calloc(count, sizeof(XcbClipInputFile));
+  if ( files == NULL ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t total = 0;
+  for (int i = 0; i < count; i++) {
+    struct stat st;
+    if ( stat(paths[i], &st) != 0 ) {
+      perrorf("%s: %s (%s)", progname, __FUNCTION__, paths[i]);
+      exit(EXIT_FAILURE);
+    }
+
+    /* procfs and sysfs files have no size to trust */
+    if ( !S_ISREG(st.st_mode) || st.st_size == 0 ) {
+      free(files);
+      return NULL;
+    }
+
+    files[i] = (XcbClipInputFile){ paths[i], total, st.st_size, 0, false };
+    total += st.st_size;
+  }
+
+  XcbClipReadJob job = {
+    .files = files, .count = count, .next = 0, .buf = store_alloc(total)
+  };
+  pthread_mutex_init(&job.lock, NULL);
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = cpus > 0 ? (size_t)cpus : 1;
+  if ( threads > XC_READ_THREADS )
+    threads = XC_READ_THREADS;
+  if ( threads > (size_t)count )
+    threads = count;
+
+  /* the calling thread reads too, whatever the others leave */
+  pthread_t tids[XC_READ_THREADS];
+  bool started[XC_READ_THREADS] = { false };
+
+  for (size_t t = 1; t < threads; t++)
+    started[t] = pthread_create(&tids[t], NULL, read_files_thread, &job) == 0;
+
+  read_files_thread(&job);
+
+  for (size_t t = 1; t < threads; t++)
+    if ( started[t] )
+      pthread_join(tids[t], NULL);
+
+  pthread_mutex_destroy(&job.lock);
+
+  /* files larger than they said are read again, to the end */
+  for (int i = 0; i < count; i++)
+    if ( files[i].longer ) {
+      store_free(job.buf);
+      free(files);
+      return NULL;
+    }
+
+  /* files read short leave gaps, closed up in order */
+  size_t off = 0;
+  for (int i = 0; i < count; i++) {
+    if ( files[i].error != 0 ) {
+      errno = files[i].error;
+      perrorf("%s: %s (%s)", progname, __FUNCTION__, files[i].path);
+      exit(EXIT_FAILURE);
+    }
+
+    if ( off != files[i].off )
+      memmove(job.buf + off, job.buf + files[i].off, files[i].len);
+    off += files[i].len;
+  }
+
+  free(files);
+  *len = off;
+  return job.buf;
+}
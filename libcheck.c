@@ -0,0 +1,180 @@
+/*
+ *  libcheck.c - round trips of selections through libxcbclip
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Sets a selection on one context and reads it back on another, both
+ * on the display in $DISPLAY and driven from a single poll() loop: a
+ * short text, then one large enough to go through INCR, then the same
+ * after cancelling a read of it partway through. Skipped, as automake
+ * tests are, when there is no display to connect to.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+
+#include "libxcbclip.h"
+
+/** Exit status telling automake the test was skipped */
+#define EXIT_SKIP 77
+
+/** Larger than any request, even with BIG-REQUESTS */
+#define LARGE_SIZE (40 << 20)
+
+/** Seconds a round trip can take */
+#define ROUND_TRIP_TIMEOUT 30
+
+static XcbClipContext *owner, *reader;
+
+/** Result of the read in progress */
+static bool got = false;
+static XcbClipStatus got_status;
+static char *got_data = NULL;
+static size_t got_len = 0;
+
+static void on_get(XcbClipContext *ctx, XcbClipSelection selection,
+		   XcbClipStatus status, const char *data, size_t len,
+		   void *user_data)
+{
+  got = true;
+  got_status = status;
+  got_len = len;
+  free(got_data);
+  got_data = NULL;
+
+  if ( status == XCBCLIP_OK && (got_data = malloc(len ? len : 1)) != NULL )
+    memcpy(got_data, data, len);
+}
+
+/**
+ * @brief Dispatch both contexts until a read is over, or for some rounds
+ * @param rounds Rounds of poll() to stop after, or 0 to wait for the read
+ * @return false if the read timed out or a connection was lost
+ */
+static bool run(int rounds)
+{
+  const time_t start = time(NULL);
+
+  for (int round = 0; !got && (rounds == 0 || round < rounds); round++) {
+    if ( time(NULL) - start > ROUND_TRIP_TIMEOUT )
+      return false;
+
+    struct pollfd fds[2] = {
+      { .fd = xcbclip_context_fd(owner), .events = POLLIN },
+      { .fd = xcbclip_context_fd(reader), .events = POLLIN }
+    };
+    poll(fds, 2, 100);
+
+    if ( xcbclip_dispatch(owner) != XCBCLIP_OK ||
+	 xcbclip_dispatch(reader) != XCBCLIP_OK )
+      return false;
+  }
+
+  return true;
+}
+
+/**
+ * @brief Set a text on one context and read it on the other
+ * @param cancel Rounds to let a first read run for before cancelling
+ *        it, or 0
+ */
+static bool round_trip(const char *name, const char *data, size_t len, int cancel)
+{
+  XcbClipStatus status = xcbclip_set(owner, XCBCLIP_CLIPBOARD, data, len, NULL, NULL);
+  if ( status != XCBCLIP_OK ) {
+    fprintf(stderr, "%s: set failed: %s\n", name, xcbclip_strerror(status));
+    return false;
+  }
+
+  if ( cancel ) {
+    got = false;
+    xcbclip_get(reader, XCBCLIP_CLIPBOARD, on_get, NULL);
+    if ( !run(cancel) ) {
+      fprintf(stderr, "%s: connection lost\n", name);
+      return false;
+    }
+
+    /* a fast server can finish the read first, which is no failure */
+    if ( !got )
+      xcbclip_cancel(reader, XCBCLIP_CLIPBOARD);
+  }
+
+  got = false;
+  status = xcbclip_get(reader, XCBCLIP_CLIPBOARD, on_get, NULL);
+  if ( status != XCBCLIP_OK || !run(0) || !got ) {
+    fprintf(stderr, "%s: read timed out or failed to start\n", name);
+    return false;
+  }
+
+  if ( got_status != XCBCLIP_OK || got_len != len ||
+       (len && memcmp(got_data, data, len) != 0) ) {
+    fprintf(stderr, "%s: read %zu bytes back (%s), not the %zu set\n",
+	    name, got_len, xcbclip_strerror(got_status), len);
+    return false;
+  }
+
+  printf("%s: %zu bytes read back\n", name, len);
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  if ( xcbclip_context_new(NULL, &owner) != XCBCLIP_OK ) {
+    fprintf(stderr, "%s: no display to test with\n", argv[0]);
+    return EXIT_SKIP;
+  }
+
+  if ( xcbclip_context_new(NULL, &reader) != XCBCLIP_OK ) {
+    fprintf(stderr, "%s: can't open a second connection\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  char *large = malloc(LARGE_SIZE);
+  if ( large == NULL ) {
+    perror(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  /* UTF-8 text, so that it can't be served as STRING */
+  for (size_t i = 0; i + 2 <= LARGE_SIZE; i += 2) {
+    if ( i % 64 == 0 )
+      memcpy(large + i, "\xc3\xa9", 2);
+    else
+      large[i] = large[i + 1] = 'a' + (i / 2) % 26;
+  }
+
+  const char small[] = "xcbclip \xe2\x80\x94 small";
+  const bool passed =
+    round_trip("small", small, sizeof(small) - 1, 0) &&
+    round_trip("empty", "", 0, 0) &&
+    round_trip("incr", large, LARGE_SIZE, 0) &&
+    round_trip("incr-cancelled", large, LARGE_SIZE, 4);
+
+  free(large);
+  free(got_data);
+  xcbclip_context_free(reader);
+  xcbclip_context_free(owner);
+
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1139 @@
+/*
+ *  libxcbclip.c - asynchronous access to X selections
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <xcb/xcb_atom.h>
+
+#ifdef HAVE_XFIXES
+# include <xcb/xfixes.h>
+#endif
+
+#include "libxcbclip.h"
+#include "xcbclip.h"
+
+#ifdef SUPPORT_ATTRIBUTE_VISIBILITY_DEFAULT
+# define XCBCLIP_EXPORT __attribute__((visibility("default")))
+#else
+# define XCBCLIP_EXPORT
+#endif
+
+/* Everything lives in the context, and nothing waits on the server
+ * once it's set up: requests that have a reply keep its sequence
+ * number, and xcbclip_dispatch() collects the replies that arrived
+ * along with the events. Failures are returned or handed to the
+ * callbacks, never reported or acted upon by the library itself.
+ *
+ * The text kernels of convert.c are shared with the xcbclip program.
+ * Its selection engine in xclib.c is not, yet: it still keeps its
+ * own global connection and state. Moving it onto a context, so that
+ * INCR, TARGETS and serving live in one place, is the next step, and
+ * until then fixes to either engine have to be carried to the other.
+ */
+
+/** Smallest chunk of an INCR transfer, whatever the server allows */
+#define XCBCLIP_MIN_CHUNK 4096
+
+/** Atoms interned when the context is created */
+enum {
+  ATOM_CLIPBOARD,
+  ATOM_TARGETS,
+  ATOM_INCR,
+  ATOM_UTF8_STRING,
+  ATOM_TEXT_PLAIN_UTF8,
+  ATOM_PROPERTY_PRIMARY,  /**< where each selection is read into */
+  ATOM_PROPERTY_SECONDARY,
+  ATOM_PROPERTY_CLIPBOARD,
+  ATOM_ALTERNATE_PRIMARY, /**< the same, while the first one is drained */
+  ATOM_ALTERNATE_SECONDARY,
+  ATOM_ALTERNATE_CLIPBOARD,
+  ATOMS
+};
+
+static const char *const atom_names[ATOMS] = {
+  [ATOM_CLIPBOARD]          = "CLIPBOARD",
+  [ATOM_TARGETS]            = "TARGETS",
+  [ATOM_INCR]               = "INCR",
+  [ATOM_UTF8_STRING]        = "UTF8_STRING",
+  [ATOM_TEXT_PLAIN_UTF8]    = "text/plain;charset=utf-8",
+  [ATOM_PROPERTY_PRIMARY]   = "XCBCLIP_PRIMARY",
+  [ATOM_PROPERTY_SECONDARY] = "XCBCLIP_SECONDARY",
+  [ATOM_PROPERTY_CLIPBOARD] = "XCBCLIP_CLIPBOARD",
+  [ATOM_ALTERNATE_PRIMARY]   = "XCBCLIP_PRIMARY_ALTERNATE",
+  [ATOM_ALTERNATE_SECONDARY] = "XCBCLIP_SECONDARY_ALTERNATE",
+  [ATOM_ALTERNATE_CLIPBOARD] = "XCBCLIP_CLIPBOARD_ALTERNATE"
+};
+
+/** Text set to selections, shared with the transfers sending it */
+struct XcbClipBuffer {
+  char *data;
+  size_t len;
+  bool ascii;            /**< can be served as STRING too */
+  unsigned int refs;     /**< only changed atomically */
+};
+
+/** States of a read of a selection */
+typedef enum {
+  GET_IDLE,
+  GET_CONVERT,           /**< waiting for the owner to convert */
+  GET_PROPERTY,          /**< waiting for the converted property */
+  GET_INCR,              /**< waiting for the next INCR chunk */
+  GET_INCR_PROPERTY      /**< waiting for the property with the chunk */
+} LibGetState;
+
+/** A read of a selection */
+typedef struct {
+  LibGetState state;
+  unsigned int slot;     /**< property read into, 0 or 1 */
+  xcb_atom_t target;     /**< target asked of the owner */
+  unsigned int sequence; /**< GetProperty request waiting for its reply */
+  xcb_atom_t type;       /**< type of the data received */
+  char *buf;
+  size_t len;
+  size_t size;
+  XcbClipGetCallback callback;
+  void *user_data;
+} LibGet;
+
+/** A read given up on, left to run without keeping the data, so that
+ * the owner isn't left waiting in the middle of an INCR transfer */
+typedef struct {
+  LibGetState state;     /**< GET_IDLE once over */
+  unsigned int sequence; /**< GetProperty request waiting for its reply */
+} LibDrain;
+
+/** A selection set by the context */
+typedef struct {
+  XcbClipBuffer *data;         /**< NULL while not owned */
+  XcbClipLostCallback lost;
+  void *user_data;
+  bool checking;         /**< ownership is being checked */
+  unsigned int check;    /**< GetSelectionOwner request checking it */
+} LibOwned;
+
+/** A selection watched for new owners */
+typedef struct {
+  XcbClipChangeCallback changed; /**< NULL while not watched */
+  void *user_data;
+} LibWatch;
+
+/** An INCR transfer to a requestor */
+typedef struct {
+  xcb_window_t requestor;
+  xcb_atom_t property;
+  xcb_atom_t type;
+  XcbClipBuffer *data;
+  size_t pos;            /**< position of the next chunk in the data */
+  unsigned int seq_first; /**< requests sent for the latest step, to */
+  unsigned int seq_last;  /**< match errors to the transfer */
+} LibTransfer;
+
+struct XcbClipContext {
+  xcb_connection_t *conn;
+  xcb_window_t win;
+  xcb_atom_t atoms[ATOMS];
+  xcb_atom_t selections[XCBCLIP_SELECTIONS];
+  size_t chunk;          /**< largest INCR chunk sent */
+  uint8_t xfixes_event;  /**< first XFIXES event, or 0 without XFIXES */
+
+  LibGet gets[XCBCLIP_SELECTIONS];
+  LibDrain drains[XCBCLIP_SELECTIONS][2]; /**< by property slot */
+  unsigned int last_drained[XCBCLIP_SELECTIONS]; /**< slot of the newest drain */
+  LibOwned owned[XCBCLIP_SELECTIONS];
+  LibWatch watches[XCBCLIP_SELECTIONS];
+
+  LibTransfer *transfers;
+  size_t transfers_count;
+  size_t transfers_size;
+};
+
+/**
+ * @brief Find the selection an atom stands for
+ * @return The selection, or XCBCLIP_SELECTIONS if it's none of ours
+ */
+static XcbClipSelection find_selection(XcbClipContext *ctx, xcb_atom_t atom)
+{
+  XcbClipSelection selection = 0;
+
+  while ( selection < XCBCLIP_SELECTIONS && ctx->selections[selection] != atom )
+    selection++;
+
+  return selection;
+}
+
+/**
+ * @brief Check the arguments every call gets
+ */
+static bool valid_selection(XcbClipContext *ctx, XcbClipSelection selection)
+{
+  return ctx != NULL && selection >= 0 && selection < XCBCLIP_SELECTIONS;
+}
+
+/**
+ * @brief Create a context, with its own connection to the X server
+ * @param display Display to connect to, or NULL for $DISPLAY
+ * @param ctx Set to the new context
+ *
+ * This is the only call that waits on the server: the atoms, the
+ * window and the maximum request length are all set up in one round
+ * trip.
+ */
+XCBCLIP_EXPORT XcbClipStatus xcbclip_context_new(const char *display,
+						  XcbClipContext **ctx)
+{
+  if ( ctx == NULL )
+    return XCBCLIP_ERROR_INVALID;
+
+  XcbClipContext *new = calloc(1, sizeof(XcbClipContext));
+  if ( new == NULL )
+    return XCBCLIP_ERROR_NOMEM;
+
+  int screen_num = 0;
+  new->conn = xcb_connect(display, &screen_num);
+  if ( xcb_connection_has_error(new->conn) ) {
+    xcb_disconnect(new->conn);
+    free(new);
+    return XCBCLIP_ERROR_CONNECTION;
+  }
+
+  xcb_screen_iterator_t screens = xcb_setup_roots_iterator(xcb_get_setup(new->conn));
+  for (; screens.rem > 1 && screen_num > 0; screen_num--)
+    xcb_screen_next(&screens);
+
+  xcb_prefetch_maximum_request_length(new->conn);
+#ifdef HAVE_XFIXES
+  xcb_prefetch_extension_data(new->conn, &xcb_xfixes_id);
+#endif
+
+  xcb_intern_atom_cookie_t cookies[ATOMS];
+  for (int i = 0; i < ATOMS; i++)
+    cookies[i] = xcb_intern_atom(new->conn, false, strlen(atom_names[i]),
+				 atom_names[i]);
+
+  static const uint32_t values[] = { XCB_EVENT_MASK_PROPERTY_CHANGE };
+  new->win = xcb_generate_id(new->conn);
+  xcb_void_cookie_t window_cookie =
+    xcb_create_window_checked(new->conn, XCB_COPY_FROM_PARENT, new->win,
+			      screens.data->root, 0, 0, 1, 1, 0,
+			      XCB_WINDOW_CLASS_INPUT_OUTPUT,
+			      screens.data->root_visual,
+			      XCB_CW_EVENT_MASK, values);
+
+  bool failed = false;
+  for (int i = 0; i < ATOMS; i++) {
+    xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(new->conn, cookies[i], NULL);
+    failed = failed || reply == NULL;
+    new->atoms[i] = reply ? reply->atom : XCB_NONE;
+    free(reply);
+  }
+
+  xcb_generic_error_t *error = xcb_request_check(new->conn, window_cookie);
+  if ( failed || error != NULL ) {
+    free(error);
+    xcb_disconnect(new->conn);
+    free(new);
+    return XCBCLIP_ERROR_CONNECTION;
+  }
+
+  /* the largest ChangeProperty, less its header */
+  const size_t max_req = (size_t)xcb_get_maximum_request_length(new->conn) * 4;
+  const size_t header = sizeof(xcb_change_property_request_t) + 4;
+  new->chunk = max_req > header + XCBCLIP_MIN_CHUNK ? max_req - header : XCBCLIP_MIN_CHUNK;
+
+#ifdef HAVE_XFIXES
+  /* its reply came before the atoms'; the version has to be
+   * negotiated before any other XFIXES request, but nothing in its
+   * reply is of use
+   */
+  const xcb_query_extension_reply_t *xfixes =
+    xcb_get_extension_data(new->conn, &xcb_xfixes_id);
+  if ( xfixes != NULL && xfixes->present ) {
+    new->xfixes_event = xfixes->first_event;
+    xcb_discard_reply(new->conn,
+		      xcb_xfixes_query_version(new->conn, XCB_XFIXES_MAJOR_VERSION,
+					       XCB_XFIXES_MINOR_VERSION).sequence);
+  }
+#endif
+
+  new->selections[XCBCLIP_PRIMARY] = PRIMARY;
+  new->selections[XCBCLIP_SECONDARY] = SECONDARY;
+  new->selections[XCBCLIP_CLIPBOARD] = new->atoms[ATOM_CLIPBOARD];
+
+  *ctx = new;
+  return XCBCLIP_OK;
+}
+
+/**
+ * @brief Close a context, and its connection
+ *
+ * Reads in progress are dropped without calling their callbacks, and
+ * the selections set by the context are given up.
+ */
+XCBCLIP_EXPORT void xcbclip_context_free(XcbClipContext *ctx)
+{
+  if ( ctx == NULL )
+    return;
+
+  for (int i = 0; i < XCBCLIP_SELECTIONS; i++) {
+    free(ctx->gets[i].buf);
+    xcbclip_buffer_unref(ctx->owned[i].data);
+  }
+
+  for (size_t i = 0; i < ctx->transfers_count; i++)
+    xcbclip_buffer_unref(ctx->transfers[i].data);
+  free(ctx->transfers);
+
+  xcb_disconnect(ctx->conn);
+  free(ctx);
+}
+
+/**
+ * @brief File descriptor to wait on for xcbclip_dispatch()
+ *
+ * Call xcbclip_dispatch() whenever it is readable.
+ */
+XCBCLIP_EXPORT int xcbclip_context_fd(XcbClipContext *ctx)
+{
+  return ctx ? xcb_get_file_descriptor(ctx->conn) : -1;
+}
+
+/**
+ * @brief Property a selection is read into
+ * @param slot 0, or 1 for the alternate one
+ */
+static xcb_atom_t read_property(XcbClipContext *ctx, XcbClipSelection selection,
+				unsigned int slot)
+{
+  return ctx->atoms[(slot ? ATOM_ALTERNATE_PRIMARY : ATOM_PROPERTY_PRIMARY) + selection];
+}
+
+/**
+ * @brief Ask the owner of a selection to convert it
+ */
+static void convert(XcbClipContext *ctx, XcbClipSelection selection,
+		    xcb_atom_t target)
+{
+  LibGet *get = &ctx->gets[selection];
+
+  get->state = GET_CONVERT;
+  get->target = target;
+  xcb_convert_selection(ctx->conn, ctx->win, ctx->selections[selection],
+			target, read_property(ctx, selection, get->slot),
+			XCB_CURRENT_TIME);
+}
+
+/**
+ * @brief Ask for the property a selection was converted into
+ *
+ * The property is read whole, which deletes it: that's what the owner
+ * waits for to send the next INCR chunk.
+ */
+static void get_property(XcbClipContext *ctx, XcbClipSelection selection,
+			 LibGetState state)
+{
+  LibGet *get = &ctx->gets[selection];
+
+  get->state = state;
+  get->sequence =
+    xcb_get_property(ctx->conn, true, ctx->win,
+		     read_property(ctx, selection, get->slot),
+		     XCB_GET_PROPERTY_TYPE_ANY, 0, UINT32_MAX / 4).sequence;
+}
+
+/**
+ * @brief Delete the property of a drained read, to let the owner go on
+ *
+ * Only the type and length of the property are asked for, which is
+ * enough to tell the start of an INCR transfer and its empty last
+ * chunk from the rest.
+ */
+static void drain_property(XcbClipContext *ctx, XcbClipSelection selection,
+			   unsigned int slot, LibGetState state)
+{
+  LibDrain *drain = &ctx->drains[selection][slot];
+  const xcb_atom_t property = read_property(ctx, selection, slot);
+
+  drain->state = state;
+  drain->sequence =
+    xcb_get_property(ctx->conn, true, ctx->win, property,
+		     XCB_GET_PROPERTY_TYPE_ANY, 0, 0).sequence;
+  xcb_delete_property(ctx->conn, ctx->win, property);
+}
+
+/**
+ * @brief Collect the property a drained read is waiting for, if it arrived
+ * @return true if the drain went on
+ */
+static bool collect_drain(XcbClipContext *ctx, XcbClipSelection selection,
+			  unsigned int slot)
+{
+  LibDrain *drain = &ctx->drains[selection][slot];
+  if ( drain->state != GET_PROPERTY && drain->state != GET_INCR_PROPERTY )
+    return false;
+
+  void *reply = NULL;
+  xcb_generic_error_t *error = NULL;
+  if ( !xcb_poll_for_reply(ctx->conn, drain->sequence, &reply, &error) )
+    return false;
+
+  /* the owner is done once it sent anything but INCR, or the empty
+   * chunk ending an INCR transfer
+   */
+  xcb_get_property_reply_t *property = reply;
+  if ( property == NULL )
+    drain->state = GET_IDLE;
+  else if ( drain->state == GET_PROPERTY )
+    drain->state = property->type == ctx->atoms[ATOM_INCR] ? GET_INCR : GET_IDLE;
+  else
+    drain->state = xcb_get_property_value_length(property) > 0 ||
+      property->bytes_after > 0 ? GET_INCR : GET_IDLE;
+
+  free(property);
+  free(error);
+  return true;
+}
+
+/**
+ * @brief Convert ISO-8859-1 text to UTF-8, in a new buffer
+ * @return The new buffer, or NULL if out of memory
+ */
+static char *new_utf8(const char *in, size_t len, size_t *out_len)
+{
+  char *out = malloc(len * 2 + 1);
+  if ( out == NULL )
+    return NULL;
+
+  *out_len = latin1_to_utf8(in, len, out);
+  return out;
+}
+
+/**
+ * @brief End a read, and hand its result to the callback
+ *
+ * The read is over before the callback runs, so that it can start
+ * another one of the same selection.
+ */
+static void finish_get(XcbClipContext *ctx, XcbClipSelection selection,
+		       XcbClipStatus status)
+{
+  LibGet get = ctx->gets[selection];
+  ctx->gets[selection] = (LibGet){ .state = GET_IDLE };
+
+  const char *data = get.buf ? get.buf : "";
+  size_t len = get.len;
+  char *converted = NULL;
+
+  if ( status == XCBCLIP_OK && get.type == STRING &&
+       !text_is_ascii(get.buf, get.len) ) {
+    if ( (converted = new_utf8(get.buf, get.len, &len)) == NULL )
+      status = XCBCLIP_ERROR_NOMEM;
+    data = converted;
+  }
+
+  if ( status != XCBCLIP_OK ) {
+    data = NULL;
+    len = 0;
+  }
+
+  get.callback(ctx, selection, status, data, len, get.user_data);
+
+  free(converted);
+  free(get.buf);
+}
+
+/**
+ * @brief Append the data of a property to a read
+ * @return false if out of memory
+ */
+static bool append_property(LibGet *get, xcb_get_property_reply_t *reply)
+{
+  const size_t len = xcb_get_property_value_length(reply);
+
+  if ( get->len + len > get->size ) {
+    size_t size = get->size ? get->size : XCBCLIP_MIN_CHUNK;
+    while ( get->len + len > size )
+      size *= 2;
+
+    char *buf = realloc(get->buf, size);
+    if ( buf == NULL )
+      return false;
+    get->buf = buf;
+    get->size = size;
+  }
+
+  memcpy(get->buf + get->len, xcb_get_property_value(reply), len);
+  get->len += len;
+  get->type = reply->type;
+  return true;
+}
+
+/**
+ * @brief Collect the property a read is waiting for, if it arrived
+ * @return true if the read went on
+ */
+static bool collect_property(XcbClipContext *ctx, XcbClipSelection selection)
+{
+  LibGet *get = &ctx->gets[selection];
+  if ( get->state != GET_PROPERTY && get->state != GET_INCR_PROPERTY )
+    return false;
+
+  void *reply = NULL;
+  xcb_generic_error_t *error = NULL;
+  if ( !xcb_poll_for_reply(ctx->conn, get->sequence, &reply, &error) )
+    return false;
+
+  xcb_get_property_reply_t *property = reply;
+  if ( property == NULL ) {
+    free(error);
+    finish_get(ctx, selection, XCBCLIP_ERROR_PROTOCOL);
+    return true;
+  }
+
+  if ( get->state == GET_PROPERTY && property->type == ctx->atoms[ATOM_INCR] ) {
+    /* reading the property started the transfer */
+    get->state = GET_INCR;
+  } else if ( property->format != 8 && property->type != XCB_NONE ) {
+    finish_get(ctx, selection, XCBCLIP_ERROR_PROTOCOL);
+  } else if ( !append_property(get, property) ) {
+    finish_get(ctx, selection, XCBCLIP_ERROR_NOMEM);
+  } else if ( get->state == GET_INCR_PROPERTY &&
+	      xcb_get_property_value_length(property) > 0 ) {
+    get->state = GET_INCR;
+  } else {
+    /* the whole data, or the empty chunk ending an INCR transfer */
+    finish_get(ctx, selection, XCBCLIP_OK);
+  }
+
+  free(property);
+  return true;
+}
+
+/**
+ * @brief Collect the answer to a check of ownership, if it arrived
+ * @return true if it did
+ */
+static bool collect_owner(XcbClipContext *ctx, XcbClipSelection selection)
+{
+  LibOwned *owned = &ctx->owned[selection];
+  if ( !owned->checking )
+    return false;
+
+  void *reply = NULL;
+  xcb_generic_error_t *error = NULL;
+  if ( !xcb_poll_for_reply(ctx->conn, owned->check, &reply, &error) )
+    return false;
+
+  owned->checking = false;
+
+  xcb_get_selection_owner_reply_t *owner = reply;
+  if ( owned->data != NULL && (owner == NULL || owner->owner != ctx->win) ) {
+    xcbclip_buffer_unref(owned->data);
+    owned->data = NULL;
+    if ( owned->lost )
+      owned->lost(ctx, selection, owned->user_data);
+  }
+
+  free(owner);
+  free(error);
+  return true;
+}
+
+/**
+ * @brief Send the next chunk of an INCR transfer
+ * @return false once the terminating empty chunk was sent
+ */
+static bool send_chunk(XcbClipContext *ctx, LibTransfer *transfer)
+{
+  const XcbClipBuffer *data = transfer->data;
+  size_t len = data->len - transfer->pos;
+  if ( len > ctx->chunk )
+    len = ctx->chunk;
+
+  transfer->seq_first = transfer->seq_last =
+    xcb_change_property(ctx->conn, XCB_PROP_MODE_REPLACE, transfer->requestor,
+			transfer->property, transfer->type, 8, len,
+			data->data + transfer->pos).sequence;
+  transfer->pos += len;
+
+  return len > 0;
+}
+
+/**
+ * @brief Drop the n-th transfer
+ */
+static void remove_transfer(XcbClipContext *ctx, size_t n)
+{
+  xcbclip_buffer_unref(ctx->transfers[n].data);
+  ctx->transfers[n] = ctx->transfers[--ctx->transfers_count];
+}
+
+/**
+ * @brief Convert a selection set by the context for a requestor
+ * @return The property the data was put in, or XCB_NONE to refuse
+ */
+static xcb_atom_t serve_target(XcbClipContext *ctx, XcbClipBuffer *data,
+			       xcb_window_t requestor, xcb_atom_t property,
+			       xcb_atom_t target)
+{
+  if ( target == ctx->atoms[ATOM_TARGETS] ) {
+    const xcb_atom_t targets[] = {
+      ctx->atoms[ATOM_TARGETS], ctx->atoms[ATOM_UTF8_STRING],
+      ctx->atoms[ATOM_TEXT_PLAIN_UTF8], STRING
+    };
+
+    xcb_change_property(ctx->conn, XCB_PROP_MODE_REPLACE, requestor,
+			property, ATOM, 32, data->ascii ? 4 : 3, targets);
+    return property;
+  }
+
+  xcb_atom_t type;
+  if ( target == ctx->atoms[ATOM_UTF8_STRING] ||
+       target == ctx->atoms[ATOM_TEXT_PLAIN_UTF8] )
+    type = ctx->atoms[ATOM_UTF8_STRING];
+  else if ( target == STRING && data->ascii )
+    type = STRING;
+  else
+    return XCB_NONE;
+
+  if ( data->len <= ctx->chunk ) {
+    xcb_change_property(ctx->conn, XCB_PROP_MODE_REPLACE, requestor,
+			property, type, 8, data->len, data->data);
+    return property;
+  }
+
+  if ( ctx->transfers_count == ctx->transfers_size ) {
+    const size_t size = ctx->transfers_size ? ctx->transfers_size * 2 : 4;
+    LibTransfer *transfers = realloc(ctx->transfers, size * sizeof(LibTransfer));
+    if ( transfers == NULL )
+      return XCB_NONE;
+    ctx->transfers = transfers;
+    ctx->transfers_size = size;
+  }
+
+  /* the requestor's deletions of the property drive the transfer */
+  static const uint32_t values[] = { XCB_EVENT_MASK_PROPERTY_CHANGE };
+  const unsigned int first =
+    xcb_change_window_attributes(ctx->conn, requestor, XCB_CW_EVENT_MASK,
+				 values).sequence;
+
+  const uint32_t incr_len = data->len > UINT32_MAX ? UINT32_MAX : data->len;
+  const unsigned int last =
+    xcb_change_property(ctx->conn, XCB_PROP_MODE_REPLACE, requestor,
+			property, ctx->atoms[ATOM_INCR], 32, 1, &incr_len).sequence;
+
+  xcbclip_buffer_ref(data);
+  ctx->transfers[ctx->transfers_count++] = (LibTransfer){
+    requestor, property, type, data, 0, first, last
+  };
+  return property;
+}
+
+/**
+ * @brief Answer a request for a selection set by the context
+ */
+static void serve_request(XcbClipContext *ctx, xcb_selection_request_event_t *request)
+{
+  const XcbClipSelection selection = find_selection(ctx, request->selection);
+  XcbClipBuffer *data = selection < XCBCLIP_SELECTIONS ? ctx->owned[selection].data : NULL;
+
+  /* obsolete requestors leave the property to us */
+  xcb_atom_t property = request->property != XCB_NONE ?
+    request->property : request->target;
+
+  const size_t transfers_count = ctx->transfers_count;
+  if ( data == NULL )
+    property = XCB_NONE;
+  else
+    property = serve_target(ctx, data, request->requestor, property,
+			    request->target);
+
+  xcb_selection_notify_event_t notify = {
+    .response_type = XCB_SELECTION_NOTIFY,
+    .time = request->time,
+    .requestor = request->requestor,
+    .selection = request->selection,
+    .target = request->target,
+    .property = property
+  };
+
+  const unsigned int sequence =
+    xcb_send_event(ctx->conn, false, request->requestor, 0,
+		   (const char *)&notify).sequence;
+
+  /* a transfer just started ends its first step with the notify */
+  if ( ctx->transfers_count > transfers_count )
+    ctx->transfers[ctx->transfers_count - 1].seq_last = sequence;
+}
+
+/**
+ * @brief Handle an event of the context's connection
+ */
+static void handle_event(XcbClipContext *ctx, xcb_generic_event_t *event)
+{
+#ifdef HAVE_XFIXES
+  if ( ctx->xfixes_event != 0 &&
+       (event->response_type & ~0x80) == ctx->xfixes_event + XCB_XFIXES_SELECTION_NOTIFY ) {
+    const xcb_xfixes_selection_notify_event_t *notify =
+      (xcb_xfixes_selection_notify_event_t *)event;
+    const XcbClipSelection selection = find_selection(ctx, notify->selection);
+    if ( selection == XCBCLIP_SELECTIONS )
+      return;
+
+    /* our own window owning the selection means the context set it,
+     * which is no change to report; a selection with no owner has no
+     * value to read
+     */
+    const LibWatch *watch = &ctx->watches[selection];
+    if ( watch->changed != NULL && notify->owner != ctx->win &&
+	 notify->owner != XCB_NONE )
+      watch->changed(ctx, selection, watch->user_data);
+    return;
+  }
+#endif
+
+  switch(event->response_type & ~0x80) {
+  case 0: {
+    /* a request without a reply failed; the ones for a requestor fail
+     * when it goes away, which ends its transfer
+     */
+    const xcb_generic_error_t *error = (xcb_generic_error_t *)event;
+    for (size_t i = 0; i < ctx->transfers_count; i++)
+      if ( error->full_sequence >= ctx->transfers[i].seq_first &&
+	   error->full_sequence <= ctx->transfers[i].seq_last ) {
+	remove_transfer(ctx, i);
+	break;
+      }
+    return;
+  }
+
+  case XCB_SELECTION_NOTIFY: {
+    const xcb_selection_notify_event_t *notify =
+      (xcb_selection_notify_event_t *)event;
+    const XcbClipSelection selection = find_selection(ctx, notify->selection);
+    if ( selection == XCBCLIP_SELECTIONS )
+      return;
+
+    /* the owner answering a read that was cancelled */
+    for (unsigned int slot = 0; slot < 2; slot++)
+      if ( ctx->drains[selection][slot].state == GET_CONVERT &&
+	   notify->property == read_property(ctx, selection, slot) ) {
+	drain_property(ctx, selection, slot, GET_PROPERTY);
+	return;
+      }
+
+    LibGet *get = &ctx->gets[selection];
+    if ( get->state != GET_CONVERT || get->target != notify->target ||
+	 (notify->property != XCB_NONE &&
+	  notify->property != read_property(ctx, selection, get->slot)) )
+      return;
+
+    /* owners that predate UTF8_STRING might still have STRING */
+    if ( notify->property == XCB_NONE && get->target != STRING )
+      convert(ctx, selection, STRING);
+    else if ( notify->property == XCB_NONE )
+      finish_get(ctx, selection, XCBCLIP_ERROR_REFUSED);
+    else
+      get_property(ctx, selection, GET_PROPERTY);
+    return;
+  }
+
+  case XCB_PROPERTY_NOTIFY: {
+    const xcb_property_notify_event_t *notify =
+      (xcb_property_notify_event_t *)event;
+
+    if ( notify->window == ctx->win ) {
+      /* the owner put the next INCR chunk in the property */
+      if ( notify->state != XCB_PROPERTY_NEW_VALUE )
+	return;
+
+      for (int i = 0; i < XCBCLIP_SELECTIONS; i++) {
+	if ( ctx->gets[i].state == GET_INCR &&
+	     notify->atom == read_property(ctx, i, ctx->gets[i].slot) )
+	  get_property(ctx, i, GET_INCR_PROPERTY);
+
+	for (unsigned int slot = 0; slot < 2; slot++)
+	  if ( ctx->drains[i][slot].state == GET_INCR &&
+	       notify->atom == read_property(ctx, i, slot) )
+	    drain_property(ctx, i, slot, GET_INCR_PROPERTY);
+      }
+      return;
+    }
+
+    /* a requestor took the last INCR chunk */
+    if ( notify->state != XCB_PROPERTY_DELETE )
+      return;
+
+    for (size_t i = 0; i < ctx->transfers_count; i++)
+      if ( ctx->transfers[i].requestor == notify->window &&
+	   ctx->transfers[i].property == notify->atom ) {
+	if ( !send_chunk(ctx, &ctx->transfers[i]) )
+	  remove_transfer(ctx, i);
+	break;
+      }
+    return;
+  }
+
+  case XCB_SELECTION_REQUEST:
+    serve_request(ctx, (xcb_selection_request_event_t *)event);
+    return;
+
+  case XCB_SELECTION_CLEAR: {
+    const xcb_selection_clear_event_t *clear =
+      (xcb_selection_clear_event_t *)event;
+    const XcbClipSelection selection = find_selection(ctx, clear->selection);
+    if ( selection == XCBCLIP_SELECTIONS || ctx->owned[selection].data == NULL )
+      return;
+
+    /* transfers already started keep their reference to the data */
+    LibOwned *owned = &ctx->owned[selection];
+    xcbclip_buffer_unref(owned->data);
+    owned->data = NULL;
+    if ( owned->lost )
+      owned->lost(ctx, selection, owned->user_data);
+    return;
+  }
+  }
+}
+
+/**
+ * @brief Handle everything the server sent, without blocking
+ * @return XCBCLIP_ERROR_CONNECTION once the connection is lost, after
+ *         failing the reads in progress
+ *
+ * To be called whenever the file descriptor of the context is
+ * readable. The callbacks of the reads that are over, and of the
+ * selections that were lost, are called from within.
+ */
+XCBCLIP_EXPORT XcbClipStatus xcbclip_dispatch(XcbClipContext *ctx)
+{
+  if ( ctx == NULL )
+    return XCBCLIP_ERROR_INVALID;
+
+  /* collecting replies can read more events, so go on until a pass
+   * finds nothing at all
+   */
+  bool progress;
+  do {
+    progress = false;
+
+    xcb_generic_event_t *event;
+    while ( (event = xcb_poll_for_event(ctx->conn)) != NULL ) {
+      handle_event(ctx, event);
+      free(event);
+      progress = true;
+    }
+
+    for (int i = 0; i < XCBCLIP_SELECTIONS; i++) {
+      progress = collect_property(ctx, i) || progress;
+      progress = collect_owner(ctx, i) || progress;
+      for (unsigned int slot = 0; slot < 2; slot++)
+	progress = collect_drain(ctx, i, slot) || progress;
+    }
+  } while ( progress );
+
+  if ( xcb_connection_has_error(ctx->conn) ) {
+    for (int i = 0; i < XCBCLIP_SELECTIONS; i++)
+      if ( ctx->gets[i].state != GET_IDLE )
+	finish_get(ctx, i, XCBCLIP_ERROR_CONNECTION);
+    return XCBCLIP_ERROR_CONNECTION;
+  }
+
+  xcb_flush(ctx->conn);
+  return XCBCLIP_OK;
+}
+
+/**
+ * @brief Start reading a selection, as text
+ * @param callback Called from xcbclip_dispatch() once the read is over
+ * @return XCBCLIP_ERROR_BUSY if the selection is being read already
+ */
+XCBCLIP_EXPORT XcbClipStatus xcbclip_get(XcbClipContext *ctx,
+					  XcbClipSelection selection,
+					  XcbClipGetCallback callback,
+					  void *user_data)
+{
+  if ( !valid_selection(ctx, selection) || callback == NULL )
+    return XCBCLIP_ERROR_INVALID;
+  if ( xcb_connection_has_error(ctx->conn) )
+    return XCBCLIP_ERROR_CONNECTION;
+
+  LibGet *get = &ctx->gets[selection];
+  if ( get->state != GET_IDLE )
+    return XCBCLIP_ERROR_BUSY;
+
+  /* the property of a cancelled read might still be drained, so the
+   * other one is used; if both are, the older drain is given up on
+   */
+  unsigned int slot = ctx->drains[selection][0].state == GET_IDLE ? 0 : 1;
+  if ( ctx->drains[selection][slot].state != GET_IDLE )
+    slot = ctx->last_drained[selection] ^ 1;
+
+  LibDrain *drain = &ctx->drains[selection][slot];
+  if ( drain->state == GET_PROPERTY || drain->state == GET_INCR_PROPERTY )
+    xcb_discard_reply(ctx->conn, drain->sequence);
+  drain->state = GET_IDLE;
+
+  *get = (LibGet){ .slot = slot, .callback = callback, .user_data = user_data };
+  convert(ctx, selection, ctx->atoms[ATOM_UTF8_STRING]);
+  xcb_flush(ctx->conn);
+  return XCBCLIP_OK;
+}
+
+/**
+ * @brief Give up on the read of a selection, without calling its callback
+ *
+ * For owners that take too long to answer; the host decides how long
+ * is too long. The owner might still be answering, or be in the middle
+ * of an INCR transfer: the read is left to run on its property without
+ * keeping the data, deleting each chunk so that the owner doesn't wait
+ * on us, and the next read of the selection uses another property.
+ */
+XCBCLIP_EXPORT XcbClipStatus xcbclip_cancel(XcbClipContext *ctx,
+					     XcbClipSelection selection)
+{
+  if ( !valid_selection(ctx, selection) )
+    return XCBCLIP_ERROR_INVALID;
+
+  LibGet *get = &ctx->gets[selection];
+  if ( get->state != GET_IDLE ) {
+    ctx->drains[selection][get->slot] = (LibDrain){ get->state, get->sequence };
+    ctx->last_drained[selection] = get->slot;
+  }
+
+  free(get->buf);
+  *get = (LibGet){ .state = GET_IDLE };
+  return XCBCLIP_OK;
+}
+
+/**
+ * @brief Set a selection to a copy of some text
+ * @param data UTF-8 text
+ * @param lost Called from xcbclip_dispatch() when another client takes
+ *        the selection, or if it couldn't be taken; can be NULL
+ *
+ * The selection is served from within xcbclip_dispatch() for as long
+ * as it's owned, INCR transfers included.
+ */
+XCBCLIP_EXPORT XcbClipStatus xcbclip_set(XcbClipContext *ctx,
+					  XcbClipSelection selection,
+					  const char *data, size_t len,
+					  XcbClipLostCallback lost,
+					  void *user_data)
+{
+  if ( !valid_selection(ctx, selection) || (data == NULL && len > 0) )
+    return XCBCLIP_ERROR_INVALID;
+
+  XcbClipBuffer *buffer = xcbclip_buffer_new(data, len);
+  if ( buffer == NULL )
+    return XCBCLIP_ERROR_NOMEM;
+
+  const XcbClipStatus status =
+    xcbclip_set_buffer(ctx, selection, buffer, lost, user_data);
+  xcbclip_buffer_unref(buffer);
+  return status;
+}
+
+/**
+ * @brief Set a selection to a buffer, without copying it
+ * @param buffer UTF-8 text; the selection keeps a reference to it
+ * @param lost As for xcbclip_set()
+ *
+ * The same buffer can be set to any number of selections, on any
+ * number of contexts.
+ */
+XCBCLIP_EXPORT XcbClipStatus xcbclip_set_buffer(XcbClipContext *ctx,
+						 XcbClipSelection selection,
+						 XcbClipBuffer *buffer,
+						 XcbClipLostCallback lost,
+						 void *user_data)
+{
+  if ( !valid_selection(ctx, selection) || buffer == NULL )
+    return XCBCLIP_ERROR_INVALID;
+  if ( xcb_connection_has_error(ctx->conn) )
+    return XCBCLIP_ERROR_CONNECTION;
+
+  /* the buffer might be the one set already */
+  LibOwned *owned = &ctx->owned[selection];
+  XcbClipBuffer *previous = owned->data;
+  owned->data = xcbclip_buffer_ref(buffer);
+  xcbclip_buffer_unref(previous);
+  owned->lost = lost;
+  owned->user_data = user_data;
+
+  /* whether the selection was taken is only known once the owner is
+   * asked for; a newer check supersedes any older one
+   */
+  if ( owned->checking )
+    xcb_discard_reply(ctx->conn, owned->check);
+
+  xcb_set_selection_owner(ctx->conn, ctx->win, ctx->selections[selection],
+			  XCB_CURRENT_TIME);
+  owned->check = xcb_get_selection_owner(ctx->conn,
+					 ctx->selections[selection]).sequence;
+  owned->checking = true;
+
+  xcb_flush(ctx->conn);
+  return XCBCLIP_OK;
+}
+
+/**
+ * @brief Give up a selection set by the context
+ *
+ * Transfers in progress are completed; the lost callback is not called.
+ */
+XCBCLIP_EXPORT XcbClipStatus xcbclip_clear(XcbClipContext *ctx,
+					    XcbClipSelection selection)
+{
+  if ( !valid_selection(ctx, selection) )
+    return XCBCLIP_ERROR_INVALID;
+
+  LibOwned *owned = &ctx->owned[selection];
+  if ( owned->data == NULL )
+    return XCBCLIP_OK;
+
+  xcbclip_buffer_unref(owned->data);
+  owned->data = NULL;
+
+  xcb_set_selection_owner(ctx->conn, XCB_NONE, ctx->selections[selection],
+			  XCB_CURRENT_TIME);
+  xcb_flush(ctx->conn);
+  return XCBCLIP_OK;
+}
+
+/**
+ * @brief Watch a selection for new owners
+ * @param changed Called from xcbclip_dispatch() whenever another client
+ *        takes the selection, or NULL to stop watching it
+ *
+ * The context taking the selection itself is not reported, so that a
+ * program copying a selection between contexts doesn't see its own
+ * copies come back.
+ */
+XCBCLIP_EXPORT XcbClipStatus xcbclip_watch(XcbClipContext *ctx,
+					    XcbClipSelection selection,
+					    XcbClipChangeCallback changed,
+					    void *user_data)
+{
+  if ( !valid_selection(ctx, selection) )
+    return XCBCLIP_ERROR_INVALID;
+  if ( xcb_connection_has_error(ctx->conn) )
+    return XCBCLIP_ERROR_CONNECTION;
+
+#ifdef HAVE_XFIXES
+  if ( ctx->xfixes_event == 0 )
+    return XCBCLIP_ERROR_UNSUPPORTED;
+
+  ctx->watches[selection] = (LibWatch){ changed, user_data };
+  xcb_xfixes_select_selection_input(ctx->conn, ctx->win, ctx->selections[selection],
+				    changed ? XCB_XFIXES_SELECTION_EVENT_MASK_SET_SELECTION_OWNER : 0);
+  xcb_flush(ctx->conn);
+  return XCBCLIP_OK;
+#else
+  return XCBCLIP_ERROR_UNSUPPORTED;
+#endif
+}
+
+/**
+ * @brief Copy some text into a new buffer
+ * @param data UTF-8 text
+ * @return The buffer, with a single reference, or NULL if out of memory
+ */
+XCBCLIP_EXPORT XcbClipBuffer *xcbclip_buffer_new(const char *data, size_t len)
+{
+  if ( data == NULL && len > 0 )
+    return NULL;
+
+  XcbClipBuffer *buffer = malloc(sizeof(XcbClipBuffer));
+  char *buf = malloc(len ? len : 1);
+  if ( buffer == NULL || buf == NULL ) {
+    free(buffer);
+    free(buf);
+    return NULL;
+  }
+
+  if ( len )
+    memcpy(buf, data, len);
+  *buffer = (XcbClipBuffer){ buf, len, text_is_ascii(buf, len), 1 };
+
+  return buffer;
+}
+
+/**
+ * @brief Take a reference to a buffer, from any thread
+ * @return The buffer
+ */
+XCBCLIP_EXPORT XcbClipBuffer *xcbclip_buffer_ref(XcbClipBuffer *buffer)
+{
+  if ( buffer != NULL )
+    __sync_add_and_fetch(&buffer->refs, 1);
+
+  return buffer;
+}
+
+/**
+ * @brief Drop a reference to a buffer, from any thread
+ *
+ * The buffer is freed with its last reference.
+ */
+XCBCLIP_EXPORT void xcbclip_buffer_unref(XcbClipBuffer *buffer)
+{
+  if ( buffer == NULL || __sync_sub_and_fetch(&buffer->refs, 1) > 0 )
+    return;
+
+  free(buffer->data);
+  free(buffer);
+}
+
+/**
+ * @brief Text of a buffer
+ * @param len Set to its length
+ */
+XCBCLIP_EXPORT const char *xcbclip_buffer_data(const XcbClipBuffer *buffer,
+						size_t *len)
+{
+  *len = buffer->len;
+  return buffer->data;
+}
+
+/**
+ * @brief Describe a status returned by the library
+ */
+XCBCLIP_EXPORT const char *xcbclip_strerror(XcbClipStatus status)
+{
+  switch(status) {
+  case XCBCLIP_OK:               return "success";
+  case XCBCLIP_ERROR_INVALID:    return "invalid argument";
+  case XCBCLIP_ERROR_NOMEM:      return "out of memory";
+  case XCBCLIP_ERROR_CONNECTION: return "connection to the X server failed";
+  case XCBCLIP_ERROR_BUSY:       return "selection already being read";
+  case XCBCLIP_ERROR_REFUSED:    return "no text in the selection";
+  case XCBCLIP_ERROR_PROTOCOL:   return "selection transfer failed";
+  case XCBCLIP_ERROR_UNSUPPORTED: return "XFIXES extension not available";
+  }
+
+  return "unknown error";
+}
@@ -0,0 +1,126 @@
+/*
+ *  libxcbclip.h - asynchronous access to X selections
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBXCBCLIP_H
+#define LIBXCBCLIP_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A context holds its own connection to the X server, and everything
+ * about the selections read and set through it; any number of contexts
+ * can be used at once, but each one from a single thread at a time.
+ *
+ * No call blocks but xcbclip_context_new(): reads and writes of the
+ * selections go on in the background, driven by xcbclip_dispatch(),
+ * which the host's event loop calls whenever the file descriptor of the
+ * context is readable. Results are handed to callbacks from within
+ * xcbclip_dispatch(); a callback can start new reads and writes.
+ *
+ * Text is always read and served as UTF-8.
+ *
+ * Buffers are the exception to the one-thread rule: their references
+ * can be taken and dropped from any thread, so that the same text can
+ * be set on contexts driven by different threads without copying it.
+ */
+
+/** A connection to an X display, with the selections read and set on it */
+typedef struct XcbClipContext XcbClipContext;
+
+/** Selections that can be read and set */
+typedef enum {
+  XCBCLIP_PRIMARY,
+  XCBCLIP_SECONDARY,
+  XCBCLIP_CLIPBOARD,
+  XCBCLIP_SELECTIONS
+} XcbClipSelection;
+
+/** Results of the calls; errors are negative */
+typedef enum {
+  XCBCLIP_OK = 0,
+  XCBCLIP_ERROR_INVALID = -1,    /**< invalid argument */
+  XCBCLIP_ERROR_NOMEM = -2,      /**< out of memory */
+  XCBCLIP_ERROR_CONNECTION = -3, /**< can't connect, or the connection was lost */
+  XCBCLIP_ERROR_BUSY = -4,       /**< the selection is already being read */
+  XCBCLIP_ERROR_REFUSED = -5,    /**< no owner, or the owner has no text */
+  XCBCLIP_ERROR_PROTOCOL = -6,   /**< the X server or the owner failed */
+  XCBCLIP_ERROR_UNSUPPORTED = -7 /**< the X server, or the build, lacks XFIXES */
+} XcbClipStatus;
+
+/** Reference-counted text, shared by the selections it's set to */
+typedef struct XcbClipBuffer XcbClipBuffer;
+
+/**
+ * @brief Called once a read of a selection is over
+ * @param data The text read, valid until the callback returns, or NULL
+ *        unless status is XCBCLIP_OK
+ */
+typedef void (*XcbClipGetCallback)(XcbClipContext *ctx, XcbClipSelection selection,
+				   XcbClipStatus status, const char *data,
+				   size_t len, void *user_data);
+
+/**
+ * @brief Called when another client takes a selection set by the context
+ */
+typedef void (*XcbClipLostCallback)(XcbClipContext *ctx, XcbClipSelection selection,
+				    void *user_data);
+
+/**
+ * @brief Called when another client takes a watched selection
+ */
+typedef void (*XcbClipChangeCallback)(XcbClipContext *ctx, XcbClipSelection selection,
+				      void *user_data);
+
+XcbClipStatus xcbclip_context_new(const char *display, XcbClipContext **ctx);
+void xcbclip_context_free(XcbClipContext *ctx);
+int xcbclip_context_fd(XcbClipContext *ctx);
+
+XcbClipStatus xcbclip_dispatch(XcbClipContext *ctx);
+
+XcbClipStatus xcbclip_get(XcbClipContext *ctx, XcbClipSelection selection,
+			  XcbClipGetCallback callback, void *user_data);
+XcbClipStatus xcbclip_cancel(XcbClipContext *ctx, XcbClipSelection selection);
+
+XcbClipStatus xcbclip_set(XcbClipContext *ctx, XcbClipSelection selection,
+			  const char *data, size_t len,
+			  XcbClipLostCallback lost, void *user_data);
+XcbClipStatus xcbclip_set_buffer(XcbClipContext *ctx, XcbClipSelection selection,
+				 XcbClipBuffer *buffer,
+				 XcbClipLostCallback lost, void *user_data);
+XcbClipStatus xcbclip_clear(XcbClipContext *ctx, XcbClipSelection selection);
+
+XcbClipStatus xcbclip_watch(XcbClipContext *ctx, XcbClipSelection selection,
+			    XcbClipChangeCallback changed, void *user_data);
+
+XcbClipBuffer *xcbclip_buffer_new(const char *data, size_t len);
+XcbClipBuffer *xcbclip_buffer_ref(XcbClipBuffer *buffer);
+void xcbclip_buffer_unref(XcbClipBuffer *buffer);
+const char *xcbclip_buffer_data(const XcbClipBuffer *buffer, size_t *len);
+
+const char *xcbclip_strerror(XcbClipStatus status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -27,10 +27,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
 #include <string.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_MEMFD_CREATE
+# include <sys/sendfile.h>
+#endif
 
 #include <xcb/xcb.h>
 #include <xcb/xcb_atom.h>
@@ -41,6 +51,8 @@
 int             sloop = 0;			/* number of loops */
 char           *sdisp = NULL;			/* X display to connect to */
 xcb_atom_t      sseln;				/* X selection to work with */
+size_t          smaxmemory = 0;			/* heap for selection data */
+double          stimeout = 0;			/* seconds to wait for a client */
 
 /* Flags for command line options */
 
@@ -48,10 +60,47 @@ xcb_atom_t      sseln;				/* X selection to work with */
 XcbClipVerboseLevel fverb = OSILENT;
 /** Filter mode */
 bool ffilt = false;
+/** Streaming mode: serve standard input while it's still being read */
+bool fstream = false;
 
 /** Direction (input if true, output if false) */
 static bool fdiri = true;
 
+/** CLIPBOARD selection requested, its atom is interned after connecting */
+static bool fclipboard = false;
+
+/** Daemon mode: serve the selections handed over by other instances */
+static bool fdaemon = false;
+
+/** Data handed over to a daemon that refused it, to serve ourselves */
+static int handoff_fd = -1;
+
+/** History entries the daemon keeps, or entry to print with -o */
+static long shistory = -1;
+/** Most bytes of selection data the daemon keeps in the history */
+static size_t shistorysize = 64 << 20;
+
+/** Positions to rotate the ring of cut buffers by */
+static int srotate = 0;
+
+/** Selections and targets to read with -o, in the order given */
+static XcbClipReadSpec *sreads = NULL;
+static size_t sreadscount = 0;
+
+/** Displays to keep the selection in sync across, comma-separated */
+static char *sbridge = NULL;
+
+/** Watch mode: print the selection whenever it changes */
+static bool fwatch = false;
+/** Written after each value printed in watch mode */
+static char *swatchsep = "\n";
+static size_t swatchseplen = 1;
+
+/** Report the time taken to set up the connection and the requests */
+static bool fsetuptime = false;
+/** Time the setup phase started at, after connecting and reading input */
+static double setup_start;
+
 /** XCB connection to the display */
 xcb_connection_t *xconn;
 /** xcbclip window ID */
@@ -65,6 +114,84 @@ static char **params = NULL;
 /** the number of non-option parameters */
 static int params_count = 0;
 
+/**
+ * @brief Parse a size in bytes, with an optional K, M or G suffix
+ * @param option Option the size was given to, for the error message
+ * @param arg Size to parse
+ *
+ * Anything but a number, followed by nothing but one of the suffixes,
+ * is a usage error, as is a size too large to be represented.
+ */
+static size_t parse_size(const char *option, const char *arg)
+{
+  char *end;
+  errno = 0;
+  unsigned long long size = strtoull(arg, &end, 10);
+
+  unsigned int shift = 0;
+  switch(toupper(*end)) {
+  case 'G': shift = 30; end++; break;
+  case 'M': shift = 20; end++; break;
+  case 'K': shift = 10; end++; break;
+  }
+
+  if ( end == arg || !isdigit((unsigned char)*arg) || *end != '\0' ||
+       errno == ERANGE || size > (SIZE_MAX >> shift) ) {
+    fprintf(stderr, "%s: invalid size for --%s: %s\n", progname, option, arg);
+    exit(EXIT_FAILURE);
+  }
+
+  return (size_t)size << shift;
+}
+
+/**
+ * @brief Replace the backslash escapes of a string in place
+ * @return The length of the string, which can contain NUL bytes
+ */
+static size_t unescape(char *str)
+{
+  size_t len = 0;
+
+  for (const char *p = str; *p; p++) {
+    if ( *p == '\\' && p[1] != '\0' ) {
+      switch(*++p) {
+      case 'n': str[len++] = '\n'; break;
+      case 't': str[len++] = '\t'; break;
+      case '0': str[len++] = '\0'; break;
+      default:  str[len++] = *p;
+      }
+    } else
+      str[len++] = *p;
+  }
+
+  return len;
+}
+
+/**
+ * @brief The selection in use, as given to --selection
+ */
+static char selection_letter()
+{
+  if ( fclipboard )
+    return 'c';
+
+  return sseln == SECONDARY ? 's' : sseln == STRING ? 'b' : 'p';
+}
+
+/**
+ * @brief Add a selection and target to read with -o
+ */
+static void add_read(char selection, const char *target)
+{
+  sreads = realloc(sreads, (sreadscount + 1) * sizeof(XcbClipReadSpec));
+  if ( sreads == NULL ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  sreads[sreadscount++] = (XcbClipReadSpec){ selection, target };
+}
+
 /* Use XrmParseCommand to parse command line options to option variable */
 static void doOptMain (int argc, char *argv[])
 {
@@ -77,6 +204,31 @@ static void doOptMain (int argc, char *argv[])
     "                   (default)\n"
     "  -o, --out        prints the selection to standard out (generally for\n"
     "                   piping to a file or program)\n"
+    "      --stream     take the selection right away and serve standard\n"
+    "                   input while it's still being read\n"
+    "      --daemon     serve the selections taken by other xcbclip -i\n"
+    "                   invocations, which hand them over and exit\n"
+    "      --history=N  with --daemon, keep the last N selections; with\n"
+    "                   -o, print the Nth latest from the daemon (0 is\n"
+    "                   the latest)\n"
+    "      --history-size=SIZE\n"
+    "                   most data the history keeps, with an optional\n"
+    "                   K, M or G suffix (default: 64M)\n"
+    "      --watch      with -o, print the selection again whenever it\n"
+    "                   changes, as --target if given, until killed\n"
+    "      --bridge=DISPLAY,DISPLAY...\n"
+    "                   keep the selection the same on all the displays,\n"
+    "                   until killed\n"
+    "      --separator=STR\n"
+    "                   written after each value printed by --watch;\n"
+    "                   \\n, \\t, \\0 and \\\\ are escapes (default: \\n)\n"
+    "      --max-memory=SIZE\n"
+    "                   keep selection data larger than SIZE in a\n"
+    "                   temporary file rather than in memory\n"
+    "      --timeout=SECONDS\n"
+    "                   give up on a selection owner, or requestor, that\n"
+    "                   makes no progress for SECONDS (default: wait\n"
+    "                   forever)\n"
     "  -l, --loops      number of selection requests to "
                        "wait for before exiting\n"
     "  -d, --display    X display to connect to (eg "
@@ -85,10 +237,20 @@ static void doOptMain (int argc, char *argv[])
     "      --selection  selection to access (\"p(rimary)\", "
                        "\"s(econdary)\", \"c(lipboard)\" or "
                        "\"b(uffer-cut)\")\n"
+    "      --target     with -o, target to convert the selection to,\n"
+    "                   rather than text; give several --selection and\n"
+    "                   --target options to read them all at once, as\n"
+    "                   records\n"
+    "      --rotate[=N] with the cut buffer, rotate the ring of the eight\n"
+    "                   cut buffers by N (default: 1) first, so that -i\n"
+    "                   keeps the previous contents\n"
     "  -v, --version    version information\n"
     "  -S, --silent     errors only, run in background (default)\n"
     "  -Q, --quiet      run in foreground, show what's happening\n"
     "  -V, --verbose    running commentary\n"
+    "      --setup-time report the time spent setting up the connection\n"
+    "      --stats[=FD] print statistics as JSON to FD (default: standard\n"
+    "                   error)\n"
     "\n"
     "Report bugs to Diego 'Flameeyes' Pettenò <flameeyes@gmail.com>\n";
 
@@ -101,14 +263,44 @@ static void doOptMain (int argc, char *argv[])
     "This is free software: you are free to change and redistribute it." "\n"
     "There is NO WARRANTY, to the extent permitted by law." "\n";
 
+  /* options without a short form */
+  enum {
+    OPT_STREAM = 256,
+    OPT_SETUP_TIME,
+    OPT_STATS,
+    OPT_DAEMON,
+    OPT_HISTORY,
+    OPT_HISTORY_SIZE,
+    OPT_MAX_MEMORY,
+    OPT_WATCH,
+    OPT_SEPARATOR,
+    OPT_TARGET,
+    OPT_ROTATE,
+    OPT_TIMEOUT,
+    OPT_BRIDGE
+  };
+
   static const char optionsString[] = "l:d:s:fiovhSQV";
   static const struct option optionsTable[] = {
     { "loops",     required_argument, NULL,   'l'  },
     { "display",   required_argument, NULL,   'd'  },
     { "selection", required_argument, NULL,   's'  },
+    { "target",    required_argument, NULL,   OPT_TARGET },
+    { "rotate",    optional_argument, NULL,   OPT_ROTATE },
     { "filter",    no_argument,       NULL,   'f'  },
     { "in",        no_argument,       NULL,   'i'  },
     { "out",       no_argument,       NULL,   'o'  },
+    { "stream",    no_argument,       NULL,   OPT_STREAM },
+    { "daemon",    no_argument,       NULL,   OPT_DAEMON },
+    { "history",   required_argument, NULL,   OPT_HISTORY },
+    { "history-size", required_argument, NULL, OPT_HISTORY_SIZE },
+    { "max-memory", required_argument, NULL,  OPT_MAX_MEMORY },
+    { "timeout",   required_argument, NULL,   OPT_TIMEOUT },
+    { "watch",     no_argument,       NULL,   OPT_WATCH },
+    { "separator", required_argument, NULL,   OPT_SEPARATOR },
+    { "bridge",    required_argument, NULL,   OPT_BRIDGE },
+    { "setup-time", no_argument,      NULL,   OPT_SETUP_TIME },
+    { "stats",     optional_argument, NULL,   OPT_STATS },
     { "version",   no_argument,       NULL,   'v'  },
     { "help",      no_argument,       NULL,   'h'  },
     { "silent",    no_argument,       NULL,   'S'  },
@@ -130,18 +322,31 @@ static void doOptMain (int argc, char *argv[])
       break;
     case 's':
       assert(optarg != NULL);
+      fclipboard = false;
       if ( strncasecmp(optarg, "p", 1) == 0 ) {
 	sseln = PRIMARY;
       } else if ( strncasecmp(optarg, "s", 1) == 0 ) {
 	sseln = SECONDARY;
       } else if ( strncasecmp(optarg, "c", 1) == 0 ) {
-	fprintf(stderr, "%s: FIXME: clipboard not implemented\n", progname);
-	exit(EXIT_FAILURE);
+	fclipboard = true;
       } else if ( strncasecmp(optarg, "b", 1) == 0 ) {
 	sseln = STRING;
       } else {
 	fprintf(stderr, "%s: unknown selection %s", progname, optarg);
+	break;
       }
+      add_read(selection_letter(), NULL);
+      break;
+    case OPT_TARGET:
+      assert(optarg != NULL);
+      /* a target goes with the selection given before it, and more
+       * targets for that selection add more conversions
+       */
+      if ( sreadscount && sreads[sreadscount - 1].target == NULL )
+	sreads[sreadscount - 1].target = optarg;
+      else
+	add_read(sreadscount ? sreads[sreadscount - 1].selection :
+		 selection_letter(), optarg);
       break;
     case 'f':
       ffilt = true;
@@ -152,6 +357,49 @@ static void doOptMain (int argc, char *argv[])
     case 'o':
       fdiri = false;
       break;
+    case OPT_ROTATE:
+      srotate = optarg ? atoi(optarg) : 1;
+      break;
+    case OPT_STREAM:
+      fstream = true;
+      break;
+    case OPT_DAEMON:
+      fdaemon = true;
+      break;
+    case OPT_HISTORY:
+      assert(optarg != NULL);
+      shistory = atol(optarg);
+      break;
+    case OPT_HISTORY_SIZE:
+      assert(optarg != NULL);
+      shistorysize = parse_size("history-size", optarg);
+      break;
+    case OPT_MAX_MEMORY:
+      assert(optarg != NULL);
+      smaxmemory = parse_size("max-memory", optarg);
+      break;
+    case OPT_TIMEOUT:
+      assert(optarg != NULL);
+      stimeout = strtod(optarg, NULL);
+      break;
+    case OPT_WATCH:
+      fwatch = true;
+      break;
+    case OPT_BRIDGE:
+      assert(optarg != NULL);
+      sbridge = optarg;
+      break;
+    case OPT_SEPARATOR:
+      assert(optarg != NULL);
+      swatchsep = optarg;
+      swatchseplen = unescape(optarg);
+      break;
+    case OPT_SETUP_TIME:
+      fsetuptime = true;
+      break;
+    case OPT_STATS:
+      sstatsfd = optarg ? atoi(optarg) : STDERR_FILENO;
+      break;
     case 'h':
       printf(usageOutput, progname);
       exit(EXIT_SUCCESS);
@@ -191,27 +439,276 @@ static void read_all(FILE *stream, char **buf, size_t *len, size_t *size) {
     if ( *len >= *size ) {
       /* double the allocated size of the buffer */
       *size *= 2;
-      *buf = realloc(*buf, *size);
-      if ( *buf == NULL ) {
-	perrorf("%s: %s", progname, __FUNCTION__);
+      *buf = store_realloc(*buf, *size);
+    }
+
+    const size_t rd = fread(*buf + *len, sizeof(char), *size - *len, stream);
+    *len += rd;
+    stats.bytes_in += rd;
+  }
+}
+
+/**
+ * @brief Map the input read for a daemon to use it directly as selection data
+ * @param fd File descriptor of the sealed memory file input_memfd() filled
+ * @param buf Pointer set to the mapped data on success
+ * @param len Pointer set to the length of the mapped data on success
+ * @return true if the file was mapped, false if it has to be read
+ *
+ * Only files sealed against writes and shrinking are mapped: the
+ * background owner serves the data for as long as it lives, and a file
+ * that changed under the mapping would change the selection after it
+ * was set, or kill the owner with SIGBUS once truncated. That's why the
+ * files given on the command line are always copied instead. The
+ * mapping is never written to, so the background owner doesn't need a
+ * private copy of the data.
+ */
+static bool map_input_fd(int fd, char **buf, size_t *len)
+{
+#if defined(HAVE_MMAP) && defined(F_GET_SEALS)
+  struct stat st;
+  const int seals = fcntl(fd, F_GET_SEALS);
+  if ( fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+       seals < 0 || !(seals & F_SEAL_SHRINK) || !(seals & F_SEAL_WRITE) )
+    return false;
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if ( map == MAP_FAILED )
+    return false;
+
+  /* INCR transfers walk the data front to back */
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  *buf = map; *len = st.st_size;
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @brief Get the input read for a daemon that refused it
+ * @param fd File descriptor of the sealed memory file input_memfd()
+ *        filled, closed before returning
+ *
+ * The file is mapped when it can be, and read back otherwise; it was
+ * sealed, so its size can't change while it's read.
+ */
+static void handoff_input_buffer(int fd, char **out_buf, size_t *out_len)
+{
+  if ( map_input_fd(fd, out_buf, out_len) ) {
+    close(fd);
+    return;
+  }
+
+  struct stat st;
+  if ( fstat(fd, &st) != 0 ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  char *buf = store_alloc(st.st_size + 1);
+  size_t len = 0;
+  while ( len < (size_t)st.st_size ) {
+    const ssize_t rd = pread(fd, buf + len, st.st_size - len, len);
+    if ( rd < 0 && errno == EINTR )
+      continue;
+    if ( rd <= 0 ) {
+      perrorf("%s: %s", progname, __FUNCTION__);
+      exit(EXIT_FAILURE);
+    }
+    len += rd;
+  }
+  close(fd);
+
+  *out_buf = buf; *out_len = len;
+}
+
+#ifdef HAVE_MEMFD_CREATE
+/**
+ * @brief Append everything that can be read from a file descriptor to another
+ * @param in File descriptor to read from
+ * @param out File descriptor to append to
+ * @param echo Also write what's read to standard output, for filter mode
+ * @return The number of bytes copied
+ *
+ * The kernel moves the data by itself where it can: splice() to and
+ * from pipes, sendfile() out of regular files. Anything else, and
+ * filter mode, goes through a buffer.
+ */
+static unsigned long long copy_fd(int in, int out, bool echo)
+{
+  unsigned long long total = 0;
+  ssize_t rd;
+
+  if ( !echo ) {
+    while ((rd = splice(in, NULL, out, NULL, 1 << 20, SPLICE_F_MOVE)) > 0)
+      total += rd;
+    if ( rd == 0 )
+      return total;
+
+    while ((rd = sendfile(out, in, NULL, 1 << 20)) > 0)
+      total += rd;
+    if ( rd == 0 )
+      return total;
+  }
+
+  char buf[1 << 16];
+  while ((rd = read(in, buf, sizeof(buf))) != 0) {
+    if ( rd < 0 && errno == EINTR )
+      continue;
+    if ( rd < 0 || write(out, buf, rd) != rd ||
+	 (echo && fwrite(buf, 1, rd, stdout) != (size_t)rd) ) {
+      perrorf("%s: %s", progname, __FUNCTION__);
+      exit(EXIT_FAILURE);
+    }
+    total += rd;
+  }
+
+  return total;
+}
+
+/**
+ * @brief Put the input in a sealed memory file to hand over to a daemon
+ * @return The file descriptor, or -1 if memory files are not available
+ */
+static int input_memfd()
+{
+  int fd = memfd_create("xcbclip", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if ( fd < 0 )
+    return -1;
+
+  if ( params_count == 0 ) {
+    stats.bytes_in += copy_fd(STDIN_FILENO, fd, ffilt);
+    if (ffilt)
+      fclose(stdout);
+  } else {
+    for(int i = 0; i < params_count; i++) {
+      int in = open(params[i], O_RDONLY);
+      if ( in < 0 ) {
+	perrorf("%s: %s (%s)", progname, __FUNCTION__, params[i]);
 	exit(EXIT_FAILURE);
       }
+
+      stats.bytes_in += copy_fd(in, fd, false);
+      close(in);
     }
+  }
+
+  /* the daemon serves the data straight from the file, so it must not
+   * change any more
+   */
+  if ( fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+	     F_SEAL_WRITE | F_SEAL_SEAL) != 0 ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  return fd;
+}
+#endif
+
+/**
+ * @brief Hand the input over to a running daemon
+ * @return true if the daemon took the selection
+ *
+ * Only what the daemon can do for us is handed over: serving a whole
+ * input, silently, until the selection is taken. When no daemon is
+ * running this costs a stat() of its socket. The input is read and
+ * sealed before connecting, so a slow producer never holds the daemon
+ * up; if the daemon refuses the data, or died, it's served by this
+ * process as usual.
+ */
+static bool handoff_input()
+{
+#ifdef HAVE_MEMFD_CREATE
+  if ( fstream || sloop != 0 || fverb != OSILENT || sseln == STRING )
+    return false;
+
+  if ( !daemon_socket_exists() )
+    return false;
+
+  /* the input is all read and sealed before connecting, so that the
+   * daemon never waits on it
+   */
+  const double input_start = stats_now();
+  const int fd = input_memfd();
+  stats_add_time(XCBCLIP_PHASE_INPUT, input_start);
+
+  const int sock = fd >= 0 ? daemon_connect() : -1;
+  const bool taken = sock >= 0 && daemon_send(sock, selection_letter(), fd);
+  if ( sock >= 0 )
+    close(sock);
+
+  if ( taken ) {
+    close(fd);
+    return true;
+  }
+
+  handoff_fd = fd;
+  return false;
+#else
+  return false;
+#endif
+}
 
-    *len += fread(*buf + *len, sizeof(char), *size - *len, stream);
+/**
+ * @brief Print an entry of the daemon's history to standard output
+ * @return The exit status of the program
+ */
+static int print_history()
+{
+#ifdef HAVE_MEMFD_CREATE
+  const int sock = daemon_connect();
+  if ( sock < 0 ) {
+    fprintf(stderr, "%s: no daemon is running to keep the history\n",
+	    progname);
+    return EXIT_FAILURE;
   }
+
+  const int fd = daemon_fetch(sock, shistory);
+  close(sock);
+
+  if ( fd < 0 ) {
+    fprintf(stderr, "%s: no history entry %ld\n", progname, shistory);
+    return EXIT_FAILURE;
+  }
+
+  report_setup_time();
+  const double write_start = stats_now();
+  stats.bytes_out += copy_fd(fd, STDOUT_FILENO, false);
+  stats_add_time(XCBCLIP_PHASE_WRITE, write_start);
+  close(fd);
+
+  return EXIT_SUCCESS;
+#else
+  fprintf(stderr, "%s: the history needs memfd_create()\n", progname);
+  return EXIT_FAILURE;
+#endif
 }
 
 void get_input_buffer(char **out_buf, size_t *out_len)
 {
+  /* the input was already read for a daemon that refused it */
+  if ( handoff_fd >= 0 ) {
+    handoff_input_buffer(handoff_fd, out_buf, out_len);
+    handoff_fd = -1;
+    return;
+  }
+
+  /* Regular files are copied, several of them in parallel, straight
+   * into a buffer of the size of them all
+   */
+  if ( params_count > 0 &&
+       (*out_buf = read_files(params, params_count, out_len)) != NULL ) {
+    stats.bytes_in += *out_len;
+    return;
+  }
+
   size_t len = 0;	/* length of sel_buf */
   size_t size = 16;	/* allocated size of sel_buf */
 
-  char *buf = malloc(size);
-  if ( buf == NULL ) {
-    perrorf("%s: %s", progname, __FUNCTION__);
-    exit(EXIT_FAILURE);
-  }
+  char *buf = store_alloc(size);
 
   /* No files specified, use stdin */
   if ( params_count == 0 ) {
@@ -236,15 +733,39 @@ void get_input_buffer(char **out_buf, size_t *out_len)
       if ( fverb == OVERBOSE )
 	fprintf(stderr, "Reading %s...\n", params[i]);
 
-      read_all(stdin, &buf, &len, &size);
+      read_all(handler, &buf, &len, &size);
+      fclose(handler);
     }
   }
 
   *out_buf = buf; *out_len = len;
 }
 
+/**
+ * @brief Report how long it took to get ready to transfer the selection
+ *
+ * Called once the connection, atoms, window and ownership needed by the
+ * chosen mode are set up; only reports the first time.
+ */
+void report_setup_time()
+{
+  static bool reported = false;
+  if ( reported )
+    return;
+
+  const double now = stats_add_time(XCBCLIP_PHASE_SETUP, setup_start);
+
+  if ( fsetuptime )
+    fprintf(stderr, "%s: setup time: %.3f ms\n", progname,
+	    (now - stats.start) * 1e3);
+
+  reported = true;
+}
+
 int main (int argc, char *argv[])
 {
+  stats.start = stats_now();
+
   sseln = PRIMARY;
 
   progname = argv[0];
@@ -253,20 +774,41 @@ int main (int argc, char *argv[])
 
   if ( fverb == OVERBOSE ) {
     fprintf(stderr, "Usign selection: ");
-    if ( sseln == PRIMARY )
+    if ( fclipboard )
+      fprintf(stderr, "CLIPBOARD\n");
+    else if ( sseln == PRIMARY )
       fprintf(stderr, "PRIMARY\n");
     else if ( sseln == SECONDARY )
       fprintf(stderr, "SECONDARY\n");
-    // else if ( sseln == XA_CLIPBOARD(dpy) )
-    //   fprintf(stderr, "CLIPBOARD\n");
     else if ( sseln == STRING )
       fprintf(stderr, "STRING\n");
     else
       assert ( 1 == 0 );
   }
   
+  /* the bridge makes a connection of its own to each display */
+  if ( sbridge != NULL )
+    do_bridge(sbridge, selection_letter());
+
+  /* a running daemon takes the selection over, without this process
+   * even connecting to the X server
+   */
+  if ( fdiri && !fdaemon && handoff_input() ) {
+    stats_print();
+    return EXIT_SUCCESS;
+  }
+
+  /* and the history is read from it without any X request */
+  if ( !fdiri && !fdaemon && shistory >= 0 ) {
+    const int res = print_history();
+    stats_print();
+    return res;
+  }
+
   /* Connect to the X server. */
-  if ( (xconn = xcb_connect(sdisp, NULL)) == NULL ) {
+  xconn = xcb_connect(sdisp, NULL);
+  setup_start = stats_add_time(XCBCLIP_PHASE_CONNECT, stats.start);
+  if ( xcb_connection_has_error(xconn) ) {
     /* couldn't connect to X server. Print error and exit */
     if (sdisp == NULL)
       sdisp = getenv("DISPLAY");
@@ -278,44 +820,68 @@ int main (int argc, char *argv[])
   /* successful */
   if (fverb == OVERBOSE)
     fprintf(stderr, "%s: connected to X server on %s.\n", progname, sdisp);
-  
-  /* Get the first screen*/
-  xcb_screen_t *screen = xcb_setup_roots_iterator(xcb_get_setup(xconn)).data;
-
-  /* Ask for a new window ID */
-  xwin = xcb_generate_id(xconn);
-
-  static const uint32_t values[] = { XCB_EVENT_MASK_PROPERTY_CHANGE };
 
-  /* Create a window to trap events */
-  xcb_void_cookie_t cookie = xcb_create_window(xconn,
-			    XCB_COPY_FROM_PARENT,
-			    xwin,
-			    screen->root,
-			    0, 0, 1, 1,
-			    0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
-			    screen->root_visual,
-			    XCB_CW_EVENT_MASK, values);
+  /* CLIPBOARD is not a predefined atom */
+  if ( fclipboard ) {
+    const intern_atom_fast_cookie_t cookie = intern_atom_fast(xconn, false, sizeof("CLIPBOARD") -1, "CLIPBOARD");
+    sseln = intern_atom_fast_reply(xconn, cookie, 0);
+    stats.replies++; stats.round_trips++;
+  }
 
-  xcb_perror(cookie, "cannot create window");
+  /* the window and the atoms are set up by the modes that need them,
+   * pipelined with their other requests
+   */
 
-  if (fdiri) {
+  if (fdaemon) {
+    do_daemon(daemon_listen(), shistory > 0 ? shistory : 0, shistorysize);
+  } else if (fdiri && fstream && params_count == 0 && sseln != STRING) {
+    /* input, served while it's being read; cut buffers need the
+     * whole data at once, so they don't stream
+     */
+    do_in_stream(STDIN_FILENO);
+  } else if (fdiri) {
     /* input */
     char *buffer = NULL;
     size_t len = 0;
 
+    const double input_start = stats_now();
     get_input_buffer(&buffer, &len);
+    stats_add_time(XCBCLIP_PHASE_INPUT, input_start);
+
+    /* reading the input is not part of the setup */
+    setup_start += stats.phases[XCBCLIP_PHASE_INPUT];
+
     if ( sseln == STRING )
-      do_in_string(buffer, len);
+      do_in_string(buffer, len, srotate);
     else
       do_in(buffer, len);
   } else {
-    if ( sseln == STRING )
-      do_out_string();
+    /* with no --selection nor --target, the selection is read as text */
+    if ( sreadscount == 0 )
+      add_read(selection_letter(), NULL);
+
+    for (size_t i = 0; i < sreadscount; i++)
+      if ( sreads[i].selection == 'b' && (sreadscount > 1 || fwatch) ) {
+	fprintf(stderr, "%s: cut buffers can only be read on their own\n",
+		progname);
+	return EXIT_FAILURE;
+      }
+
+    if ( fwatch && sreadscount > 1 ) {
+      fprintf(stderr, "%s: --watch reads a single selection\n", progname);
+      return EXIT_FAILURE;
+    }
+
+    if ( sreads[0].selection == 'b' )
+      do_out_string(srotate);
+    else if ( fwatch )
+      do_watch(&sreads[0], swatchsep, swatchseplen);
     else
-      do_out();
+      do_out(sreads, sreadscount);
   }
 
+  stats_print();
+
   /* Disconnect from the X server */
   xcb_disconnect(xconn);
   
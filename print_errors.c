@@ -51,6 +51,7 @@ void perrorf(const char *format, ...)
 
 void xcb_perror(xcb_void_cookie_t cookie, const char *errstr) {
   xcb_generic_error_t *error = xcb_request_check(xconn, cookie);
+  stats.replies++;
   if ( error == NULL )
     return;
   
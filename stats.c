@@ -0,0 +1,116 @@
+/*
+ *  stats.c - per-invocation counters and phase timings
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <time.h>
+
+#include "xcbclip.h"
+
+/** Counters of this invocation; always kept, only printed with --stats */
+XcbClipStats stats;
+
+/** File descriptor to print the statistics to, or -1 not to print them */
+int sstatsfd = -1;
+
+static const char *const phase_names[XCBCLIP_PHASES] = {
+  [XCBCLIP_PHASE_CONNECT]    = "connect",
+  [XCBCLIP_PHASE_SETUP]      = "setup",
+  [XCBCLIP_PHASE_INPUT]      = "input",
+  [XCBCLIP_PHASE_WAIT_OWNER] = "wait_owner",
+  [XCBCLIP_PHASE_INCR_WAIT]  = "incr_wait",
+  [XCBCLIP_PHASE_WRITE]      = "write",
+  [XCBCLIP_PHASE_SERVE]      = "serve"
+};
+
+/**
+ * @brief Current time in seconds, from a monotonic clock
+ */
+double stats_now()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Account the time elapsed since start to a phase
+ * @param phase Phase to account the time to
+ * @param start Value of stats_now() when the phase started
+ * @return The current time, to chain into the next phase
+ */
+double stats_add_time(XcbClipPhase phase, double start)
+{
+  const double now = stats_now();
+  stats.phases[phase] += now - start;
+  return now;
+}
+
+/**
+ * @brief Record the size of a newly allocated data buffer
+ */
+void stats_buffer(size_t size)
+{
+  stats.reallocs++;
+  if ( size > stats.peak_buffer )
+    stats.peak_buffer = size;
+}
+
+/**
+ * @brief Print the statistics as a JSON object, if requested
+ *
+ * Every process prints its own object: in silent mode the background
+ * owner prints one more when it exits.
+ */
+void stats_print()
+{
+  if ( sstatsfd < 0 )
+    return;
+
+  /* XCB doesn't tell the sequence number of the last request, but a
+   * NoOperation gets the next one
+   */
+  if ( xconn != NULL && !xcb_connection_has_error(xconn) )
+    stats.requests = xcb_no_operation(xconn).sequence - 1;
+
+  /* build the whole object first, so that it is written at once even
+   * when the background owner shares the file descriptor
+   */
+  char phases[XCBCLIP_PHASES * 32 + 32];
+  size_t off = 0;
+  for (int i = 0; i < XCBCLIP_PHASES; i++)
+    off += snprintf(phases + off, sizeof(phases) - off, "\"%s\":%.3f,",
+		    phase_names[i], stats.phases[i] * 1e3);
+  snprintf(phases + off, sizeof(phases) - off, "\"total\":%.3f",
+	   (stats_now() - stats.start) * 1e3);
+
+  dprintf(sstatsfd,
+	  "{\"phases_ms\":{%s},"
+	  "\"requests\":%lu,\"replies\":%lu,\"round_trips\":%lu,"
+	  "\"events\":%lu,\"errors\":%lu,"
+	  "\"bytes_in\":%llu,\"bytes_out\":%llu,"
+	  "\"incr_chunks\":%lu,\"reallocs\":%lu,\"peak_buffer\":%zu}\n",
+	  phases,
+	  stats.requests, stats.replies, stats.round_trips,
+	  stats.events, stats.errors,
+	  stats.bytes_in, stats.bytes_out,
+	  stats.incr_chunks, stats.reallocs, stats.peak_buffer);
+}
@@ -0,0 +1,261 @@
+/*
+ *  store.c - buffers for selection data, spilled to a file past a limit
+ *  Copyright (c) 2008 Diego 'Flameeyes' Pettenò
+ *
+ *  This file is part of xcbclip.
+ *
+ *  xcbclip is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  xcbclip is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
+
+#include "xcbclip.h"
+
+/* Buffers are allocated on the heap as long as they fit in the memory
+ * limit set with --max-memory, together with the other heap buffers.
+ * Past it, a buffer is moved to an unlinked temporary file and used
+ * through a shared mapping of the file: its pages are backed by the
+ * file rather than by anonymous memory, so the kernel can write them
+ * out and drop them instead of killing the process.
+ */
+
+/** A buffer handed out by the store */
+typedef struct {
+  char *data;
+  size_t size;
+  int fd;                /**< file the buffer lives in, or -1 on the heap */
+} StoreBuffer;
+
+/** Table of the buffers handed out */
+static StoreBuffer *buffers = NULL;
+static size_t buffers_count = 0;
+static size_t buffers_size = 0;
+
+/** Size of the buffers kept on the heap */
+static size_t heap_used = 0;
+
+/**
+ * @brief Find the entry of a buffer in the table
+ * @return The entry, or NULL if the buffer is not from the store
+ */
+static StoreBuffer *find_buffer(const char *data)
+{
+  for (size_t i = 0; i < buffers_count; i++)
+    if ( buffers[i].data == data )
+      return &buffers[i];
+
+  return NULL;
+}
+
+/**
+ * @brief Add an empty entry to the table
+ */
+static StoreBuffer *add_buffer()
+{
+  if ( buffers_count == buffers_size ) {
+    buffers_size = buffers_size ? buffers_size * 2 : 8;
+    buffers = realloc(buffers, buffers_size * sizeof(StoreBuffer));
+    if ( buffers == NULL ) {
+      perrorf("%s: %s", progname, __FUNCTION__);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  StoreBuffer *buffer = &buffers[buffers_count++];
+  *buffer = (StoreBuffer){ NULL, 0, -1 };
+  return buffer;
+}
+
+#ifdef HAVE_MMAP
+/**
+ * @brief Create a file to spill a buffer to
+ * @return File descriptor of an unlinked file, or -1
+ *
+ * The file goes in $TMPDIR, or /tmp, so that it's backed by a disk
+ * where there is one; an anonymous memory file is the last resort.
+ */
+static int spill_file()
+{
+  const char *dir = getenv("TMPDIR");
+  if ( dir == NULL || *dir == '\0' )
+    dir = "/tmp";
+
+  int fd = -1;
+#ifdef O_TMPFILE
+  fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if ( fd >= 0 )
+    return fd;
+#endif
+
+  char path[PATH_MAX];
+  if ( snprintf(path, sizeof(path), "%s/xcbclip-XXXXXX", dir) < (int)sizeof(path) &&
+       (fd = mkstemp(path)) >= 0 ) {
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+  }
+
+#ifdef HAVE_MEMFD_CREATE
+  fd = memfd_create("xcbclip-store", MFD_CLOEXEC);
+#endif
+  return fd;
+}
+
+/**
+ * @brief Resize a buffer living in a file
+ * @return false if the file couldn't be resized or mapped
+ */
+static bool map_buffer(StoreBuffer *buffer, size_t size)
+{
+  if ( ftruncate(buffer->fd, size) != 0 )
+    return false;
+
+  /* the contents stay in the file, only the mapping is replaced */
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   buffer->fd, 0);
+  if ( map == MAP_FAILED )
+    return false;
+
+  if ( buffer->data != NULL )
+    munmap(buffer->data, buffer->size);
+
+  /* the data is written and read front to back */
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  buffer->data = map;
+  buffer->size = size;
+  return true;
+}
+
+/**
+ * @brief Move a buffer from the heap to a file
+ * @return false if it has to stay on the heap
+ */
+static bool spill_buffer(StoreBuffer *buffer, size_t size)
+{
+  StoreBuffer spilled = { NULL, 0, spill_file() };
+  if ( spilled.fd < 0 )
+    return false;
+
+  if ( !map_buffer(&spilled, size) ) {
+    close(spilled.fd);
+    return false;
+  }
+
+  if ( buffer->data != NULL ) {
+    memcpy(spilled.data, buffer->data, buffer->size < size ? buffer->size : size);
+    free(buffer->data);
+    heap_used -= buffer->size;
+  }
+
+  if ( fverb == OVERBOSE )
+    fprintf(stderr, "Storing %zu bytes of selection data in a file\n", size);
+
+  *buffer = spilled;
+  return true;
+}
+#endif
+
+/**
+ * @brief Resize a buffer, or allocate a new one
+ * @param data Buffer to resize, or NULL to allocate one
+ * @param size New size of the buffer
+ * @return The buffer, possibly moved; its contents are kept up to the
+ *         lesser of the old and new sizes
+ *
+ * The buffer moves to a file when the heap buffers would go over
+ * smaxmemory; once in a file it stays there.
+ */
+char *store_realloc(char *data, size_t size)
+{
+  StoreBuffer *buffer = data ? find_buffer(data) : add_buffer();
+  assert(buffer != NULL);
+
+  if ( size == 0 )
+    size = 1;
+
+#ifdef HAVE_MMAP
+  if ( buffer->fd >= 0 ) {
+    if ( !map_buffer(buffer, size) ) {
+      perrorf("%s: %s", progname, __FUNCTION__);
+      exit(EXIT_FAILURE);
+    }
+
+    stats_buffer(size);
+    return buffer->data;
+  }
+
+  if ( smaxmemory && heap_used - buffer->size + size > smaxmemory &&
+       spill_buffer(buffer, size) ) {
+    stats_buffer(size);
+    return buffer->data;
+  }
+#endif
+
+  char *heap = realloc(buffer->data, size);
+  if ( heap == NULL ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  heap_used += size - buffer->size;
+  buffer->data = heap;
+  buffer->size = size;
+
+  stats_buffer(size);
+  return heap;
+}
+
+/**
+ * @brief Allocate a buffer
+ * @see store_realloc()
+ */
+char *store_alloc(size_t size)
+{
+  return store_realloc(NULL, size);
+}
+
+/**
+ * @brief Free a buffer allocated by the store
+ */
+void store_free(char *data)
+{
+  StoreBuffer *buffer = data ? find_buffer(data) : NULL;
+  if ( buffer == NULL )
+    return;
+
+#ifdef HAVE_MMAP
+  if ( buffer->fd >= 0 ) {
+    munmap(buffer->data, buffer->size);
+    close(buffer->fd);
+  } else
+#endif
+  {
+    free(buffer->data);
+    heap_used -= buffer->size;
+  }
+
+  *buffer = buffers[--buffers_count];
+}
@@ -32,7 +32,8 @@ typedef enum {
   OVERBOSE
 } XcbClipVerboseLevel;
 
-/* maximume size to read/write to/from a property at once in bytes */
+/* minimum size to read/write to/from a property at once in bytes; the
+ * actual size is taken from the server's maximum request length */
 #define XC_CHUNK 4096
 
 extern int sloop;
@@ -41,18 +42,146 @@ extern xcb_atom_t sseln;
 
 extern XcbClipVerboseLevel fverb;
 extern bool ffilt;
+extern bool fstream;
+
+extern size_t smaxmemory;
+extern double stimeout;
 
 extern xcb_connection_t *xconn;
 extern xcb_window_t xwin;
 
 extern const char *progname;
 
+/* phases of an invocation timed by the statistics */
+typedef enum {
+  XCBCLIP_PHASE_CONNECT,    /**< connecting to the X server */
+  XCBCLIP_PHASE_SETUP,      /**< atoms, window and selection ownership */
+  XCBCLIP_PHASE_INPUT,      /**< reading the input data */
+  XCBCLIP_PHASE_WAIT_OWNER, /**< waiting for the owner to convert */
+  XCBCLIP_PHASE_INCR_WAIT,  /**< waiting for INCR chunks */
+  XCBCLIP_PHASE_WRITE,      /**< writing to standard output */
+  XCBCLIP_PHASE_SERVE,      /**< serving the selection to requestors */
+  XCBCLIP_PHASES
+} XcbClipPhase;
+
+/* counters of an invocation, printed with --stats */
+typedef struct {
+  double start;                  /**< time the program started at */
+  double phases[XCBCLIP_PHASES]; /**< seconds spent in each phase */
+  unsigned long requests;        /**< X requests sent */
+  unsigned long replies;         /**< replies and checks collected */
+  unsigned long round_trips;     /**< times we blocked on the server */
+  unsigned long events;          /**< events received */
+  unsigned long errors;          /**< errors received as events */
+  unsigned long long bytes_in;   /**< selection bytes read in */
+  unsigned long long bytes_out;  /**< selection bytes sent out */
+  unsigned long incr_chunks;     /**< INCR chunks sent or received */
+  unsigned long reallocs;        /**< data buffer (re)allocations */
+  size_t peak_buffer;            /**< largest data buffer allocated */
+} XcbClipStats;
+
+extern XcbClipStats stats;
+extern int sstatsfd;
+
+/* main.c */
+void report_setup_time();
+
 /* xclib.c */
-void do_in_string(char *buf, size_t len);
-void do_out_string();
+
+/** A selection and target to read, as given on the command line */
+typedef struct {
+  char selection;        /**< 'p', 's', 'c' or 'b', as given to --selection */
+  const char *target;    /**< name of the target, or NULL to read text */
+} XcbClipReadSpec;
+
+void do_in_string(char *buf, size_t len, int rotate);
+void do_out_string(int rotate);
 
 void do_in(char *buf, size_t len);
-void do_out();
+void do_in_stream(int fd);
+void do_out(const XcbClipReadSpec *specs, size_t count);
+void do_watch(const XcbClipReadSpec *spec,
+	      const char *separator, size_t separator_len);
+void do_daemon(int listen_fd, unsigned int history, size_t history_size);
+void go_background();
+
+/* eventloop.c */
+typedef void (*XcbClipFdHandler)(int fd, short revents, void *arg);
+
+void loop_watch_fd(int fd, short events, XcbClipFdHandler handler, void *arg);
+void loop_unwatch_fd(int fd);
+bool loop_wait(double deadline);
+xcb_generic_event_t *loop_wait_for_event(double deadline);
+double loop_deadline();
+
+/* bridge.c */
+void do_bridge(char *names, char selection);
+
+/* input.c */
+char *read_files(char *const *paths, int count, size_t *len);
+
+/* convert.c */
+typedef enum {
+  XCBCLIP_SIMD_SCALAR,
+  XCBCLIP_SIMD_SSE2,
+  XCBCLIP_SIMD_AVX2,
+  XCBCLIP_SIMD_LEVELS
+} XcbClipSimdLevel;
+
+bool convert_simd_supported(XcbClipSimdLevel level);
+bool convert_set_simd_level(XcbClipSimdLevel level);
+const char *convert_simd_name(XcbClipSimdLevel level);
+
+bool text_is_ascii(const char *buf, size_t len);
+bool text_is_utf8(const char *buf, size_t len);
+size_t latin1_to_utf8(const char *in, size_t len, char *out);
+size_t utf8_to_latin1(const char *in, size_t len, char *out, bool *lossless);
+
+/* daemon.c */
+typedef enum {
+  XCBCLIP_DAEMON_TAKE,      /**< take a selection over */
+  XCBCLIP_DAEMON_FETCH      /**< fetch an entry of the history */
+} XcbClipDaemonOp;
+
+/* a request received by the daemon */
+typedef struct {
+  XcbClipDaemonOp op;
+  char selection;           /**< selection to take, as for --selection */
+  unsigned int index;       /**< history entry to fetch */
+  int fd;                   /**< data to take, or -1 */
+} XcbClipDaemonRequest;
+
+int daemon_connect();
+bool daemon_socket_exists();
+int daemon_listen();
+void daemon_unlink();
+bool daemon_send(int sock, char selection, int fd);
+int daemon_fetch(int sock, unsigned int index);
+bool daemon_receive(int sock, XcbClipDaemonRequest *request);
+void daemon_reply(int sock, bool ok, int fd);
+
+/* history.c */
+void history_init(unsigned int count, size_t size);
+void history_add(const char *data, size_t len);
+bool history_get(unsigned int index, const char **data, size_t *len);
+int history_open(unsigned int index);
+
+/* compress.c */
+char *compress_data(const char *data, size_t len, size_t *out_len);
+bool decompress_chunk(const void *data, size_t len,
+		      void (*sink)(const void *data, size_t len));
+bool decompress_finish(void (*sink)(const void *data, size_t len));
+
+/* store.c */
+char *store_alloc(size_t size);
+char *store_realloc(char *data, size_t size);
+void store_free(char *data);
+
+/* stats.c */
+double stats_now();
+double stats_add_time(XcbClipPhase phase, double start);
+void stats_buffer(size_t size);
+void stats_print();
 
 /* print_errors.c */
 void perrorf(const char *format, ...)
@@ -21,18 +21,32 @@
  *  along with xcbclip.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <config.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/xcb_atom.h>
 #include <xcb/xcb_property.h>
+#ifdef HAVE_XFIXES
+# include <xcb/xfixes.h>
+#endif
 #include "xcbclip.h"
-#include "xcb-contrib.h"
 
 typedef enum {
   XCLIP_OUT_SENTCONVSEL, /**< sent a request */
@@ -42,514 +56,2675 @@ typedef enum {
 typedef enum {
   XCLIP_IN_NONE,
   XCLIP_IN_SELREQ,
-  XCLIP_IN_INCR
+  XCLIP_IN_INCR,         /**< waiting for the requestor to delete the property */
+  XCLIP_IN_INCR_READY,   /**< property deleted, next chunk is due */
+  XCLIP_IN_INCR_WAIT,    /**< incr reader caught up with a streaming input */
+  XCLIP_IN_MULTIPLE      /**< reading the target list of a MULTIPLE request */
 } XClipInContext;
 
+/** Encodings the selection data can be served in */
+typedef enum {
+  XCLIP_FORM_RAW,        /**< the data as it was read */
+  XCLIP_FORM_LATIN1,     /**< ISO-8859-1 */
+  XCLIP_FORM_UTF8,       /**< UTF-8 */
+  XCLIP_FORM_CTEXT,      /**< COMPOUND_TEXT */
+  XCLIP_FORM_TEXT,       /**< TEXT: ISO-8859-1 if lossless, else COMPOUND_TEXT */
+  XCLIP_FORM_ZSTD,       /**< the data as it was read, compressed for another xcbclip */
+  XCLIP_FORMS
+} XClipForm;
+
+/** Selection data being served */
+typedef struct {
+  char *data;            /**< data read so far */
+  size_t len;            /**< length of data */
+  bool complete;         /**< no more data is going to be appended */
+  unsigned int refs;     /**< owner and transfers using the data */
+
+  bool analysed;         /**< the flags below are valid */
+  bool ascii;            /**< data is 7-bit ASCII */
+  bool utf8;             /**< data is UTF-8, rather than ISO-8859-1 */
+  bool latin1;           /**< data can be represented in ISO-8859-1 */
+
+  /** conversions of the complete data, computed on first request; forms
+   * with identical bytes share the same buffer
+   */
+  struct {
+    const char *data;
+    size_t len;
+    bool ready;
+  } forms[XCLIP_FORMS];
+} XClipInData;
+
+/** An INCR transfer or MULTIPLE request in flight, keyed by requestor window
+ * and property
+ */
+typedef struct {
+  xcb_window_t requestor;
+  xcb_atom_t property;
+  XClipInData *data;     /**< data being sent, referenced until the end */
+  size_t pos;            /**< position of the next chunk in the data */
+  XClipForm form;        /**< form of the data being sent */
+  xcb_atom_t type;       /**< type of the property */
+  XClipInContext context;
+  unsigned int seq_first; /**< first request sent for the latest step */
+  unsigned int seq_last;  /**< last request sent for the latest step */
+  bool notify_pending;    /**< the SelectionNotify starting it is not sent yet */
+  double deadline;        /**< time the requestor has to take the chunk by, or 0 */
+  xcb_atom_t selection;   /**< selection of a MULTIPLE request, for its notify */
+  xcb_timestamp_t time;   /**< time of a MULTIPLE request, for its notify */
+} XClipTransfer;
+
+/** Table of the INCR transfers in flight */
+static XClipTransfer *transfers = NULL;
+static size_t transfers_count = 0;
+static size_t transfers_size = 0;
+/** Index of the transfer the scheduler serves first on its next pass */
+static size_t transfers_next = 0;
+
 static xcb_atom_t incr_atom;
 static xcb_atom_t targets_atom;
 static xcb_atom_t xclip_out_atom;
+static xcb_atom_t utf8_string_atom;
+static xcb_atom_t text_atom;
+static xcb_atom_t compound_text_atom;
+static xcb_atom_t text_plain_atom;
+static xcb_atom_t text_plain_utf8_atom;
+static xcb_atom_t zstd_atom;
+static xcb_atom_t raw_atom;
+static xcb_atom_t clipboard_atom;
+static xcb_atom_t multiple_atom;
+static xcb_atom_t atom_pair_atom;
+static xcb_atom_t owner_primary_atom;
+static xcb_atom_t owner_secondary_atom;
+static xcb_atom_t owner_clipboard_atom;
+
+/** Names of the atoms interned by intern_internal_atoms() */
+static const char *const internal_atom_names[] = {
+  "INCR", "XCLIP_OUT", "TARGETS",
+  "UTF8_STRING", "TEXT", "COMPOUND_TEXT",
+  "text/plain", "text/plain;charset=utf-8",
+  "application/x-xcbclip-zstd", "application/x-xcbclip-raw",
+  "CLIPBOARD",
+  "MULTIPLE", "ATOM_PAIR",
+  "XCBCLIP_OWNER_PRIMARY", "XCBCLIP_OWNER_SECONDARY",
+  "XCBCLIP_OWNER_CLIPBOARD"
+};
+/** Where find_internal_atoms() stores them, in the same order */
+static xcb_atom_t *const internal_atoms[] = {
+  &incr_atom, &xclip_out_atom, &targets_atom,
+  &utf8_string_atom, &text_atom, &compound_text_atom,
+  &text_plain_atom, &text_plain_utf8_atom,
+  &zstd_atom, &raw_atom, &clipboard_atom,
+  &multiple_atom, &atom_pair_atom,
+  &owner_primary_atom, &owner_secondary_atom,
+  &owner_clipboard_atom
+};
+
+/** A conversion target we can serve */
+typedef struct {
+  const xcb_atom_t *atom;  /**< target atom */
+  XClipForm form;          /**< form of the data served for it */
+} XClipTarget;
+
+/** Targets we serve, in order of preference as advertised by TARGETS */
+static const XClipTarget served_targets[] = {
+#ifdef HAVE_ZSTD
+  { &zstd_atom,            XCLIP_FORM_ZSTD },
+#endif
+  { &raw_atom,             XCLIP_FORM_RAW },
+  { &utf8_string_atom,     XCLIP_FORM_UTF8 },
+  { &text_plain_utf8_atom, XCLIP_FORM_UTF8 },
+  { &compound_text_atom,   XCLIP_FORM_CTEXT },
+  { &text_atom,            XCLIP_FORM_TEXT },
+  { &STRING,               XCLIP_FORM_LATIN1 },
+  { &text_plain_atom,      XCLIP_FORM_RAW }
+};
+
+#define SERVED_TARGETS (sizeof(served_targets)/sizeof(served_targets[0]))
+
+#define INTERNAL_ATOMS (sizeof(internal_atom_names)/sizeof(internal_atom_names[0]))
+
+static intern_atom_fast_cookie_t internal_atom_cookies[INTERNAL_ATOMS];
+
+/**
+ * @brief Send the requests for the internal atoms, without waiting
+ *
+ * The replies are collected by find_internal_atoms(), so that other
+ * setup requests can be sent in between.
+ */
+static void intern_internal_atoms() {
+  static bool executed = false;
+  if ( executed ) return;
+
+  /* BIG-REQUESTS setup goes out together with the atoms */
+  xcb_prefetch_maximum_request_length(xconn);
+
+  for (size_t i = 0; i < INTERNAL_ATOMS; i++)
+    internal_atom_cookies[i] = intern_atom_fast(xconn, false,
+						strlen(internal_atom_names[i]),
+						internal_atom_names[i]);
+
+  executed = true;
+}
 
 static void find_internal_atoms() {
   static bool executed = false;
   if ( executed ) return;
 
-  {
-    const intern_atom_fast_cookie_t cookie = intern_atom_fast(xconn, false, sizeof("INCR") -1, "INCR");
-    incr_atom = intern_atom_fast_reply(xconn, cookie, 0);
-  }
+  intern_internal_atoms();
 
-  {
-    const intern_atom_fast_cookie_t cookie = intern_atom_fast(xconn, false, sizeof("XCLIP_OUT") -1, "XCLIP_OUT");
-    xclip_out_atom = intern_atom_fast_reply(xconn, cookie, 0);
-  }
+  for (size_t i = 0; i < INTERNAL_ATOMS; i++)
+    *internal_atoms[i] = intern_atom_fast_reply(xconn, internal_atom_cookies[i], 0);
 
-  {
-    const intern_atom_fast_cookie_t cookie = intern_atom_fast(xconn, false, sizeof("TARGETS") -1, "TARGETS");
-    targets_atom = intern_atom_fast_reply(xconn, cookie, 0);
-  }
+  stats.replies += INTERNAL_ATOMS;
+  stats.round_trips++;
 
   executed = true;
 }
 
-/* put data into a selection, in response to a SelecionRequest event from
- * another window (and any subsequent events relating to an INCR transfer).
+/** Creation of xwin, checked once a reply is waited for anyway */
+static xcb_void_cookie_t xwin_cookie;
+
+/**
+ * @brief Create the window used to own and to receive selections
  *
- * Arguments are:
+ * The request is not waited on; check_window() reports its failure
+ * after some other round trip happened.
+ */
+static void create_window()
+{
+  /* Get the first screen*/
+  xcb_screen_t *screen = xcb_setup_roots_iterator(xcb_get_setup(xconn)).data;
+
+  /* Ask for a new window ID */
+  xwin = xcb_generate_id(xconn);
+
+  static const uint32_t values[] = { XCB_EVENT_MASK_PROPERTY_CHANGE };
+
+  /* Create a window to trap events */
+  xwin_cookie = xcb_create_window_checked(xconn,
+					  XCB_COPY_FROM_PARENT,
+					  xwin,
+					  screen->root,
+					  0, 0, 1, 1,
+					  0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+					  screen->root_visual,
+					  XCB_CW_EVENT_MASK, values);
+}
+
+static void check_window()
+{
+  xcb_perror(xwin_cookie, "cannot create window");
+}
+
+/**
+ * @brief Root window of the first screen, where cut buffers live
+ */
+static xcb_window_t root_window()
+{
+  return xcb_setup_roots_iterator(xcb_get_setup(xconn)).data->root;
+}
+
+/**
+ * @brief Property of the root window naming the xcbclip owner of a
+ *        selection
  *
- * A display
- * 
- * A window
- * 
- * The event to respond to
- * 
- * A pointer to an Atom. This gets set to the property nominated by the other
- * app in it's SelectionRequest. Things are likely to break if you change the
- * value of this yourself.
- * 
- * A pointer to an array of chars to read selection data from.
- * 
- * The length of the array of chars.
- *
- * In the case of an INCR transfer, the position within the array of chars
- * that is being processed.
- *
- * The context that event is the be processed within.
- */
-static int doIn_internal_loop(
-	 xcb_window_t* win,
-	 xcb_generic_event_t* evt,
-	 xcb_atom_t* pty,
-	 char* txt,
-	 size_t len,
-	 size_t* pos,
-	 XClipInContext* context
-)
-{
-  unsigned long chunk_len;	/* length of current chunk (for incr
-				 * transfers only)
-				 */
-
-  xcb_void_cookie_t cookie;
-  switch (*context) {
-  case XCLIP_IN_NONE: {
-    if ((evt->response_type & ~0x80) != XCB_SELECTION_REQUEST)
-      return 0;
-
-    xcb_selection_request_event_t *req_event = (xcb_selection_request_event_t *)evt;
-    
-    /* set the window and property that is being used */
-    *win = req_event->requestor;
-    *pty = req_event->property;
-
-    /* reset position to 0 */
-    *pos = 0;
-		
-    /* put the data into an property */
-    if (req_event->target == targets_atom) {
-      xcb_atom_t types[] = { targets_atom, STRING };
-			
-      /* send data all at once (not using INCR) */
-      cookie = xcb_change_property_checked(xconn,
-			  XCB_PROP_MODE_REPLACE,
-			  *win,
-			  *pty,
-			  targets_atom,
-			  8,
-			  sizeof(types), types);
-    } else if (len > XC_CHUNK) {
-      /* send INCR response */
-      cookie = xcb_change_property_checked(xconn,
-			  XCB_PROP_MODE_REPLACE,
-			  *win,
-			  *pty,
-			  incr_atom,
-			  32,
-			  0, NULL);
-
-	*context = XCLIP_IN_INCR;
-    } else {
-      /* send data all at once (not using INCR) */
-      cookie = xcb_change_property_checked(xconn,
-			  XCB_PROP_MODE_REPLACE,
-			  *win,
-			  *pty,
-			  STRING,
-			  8,
-			  len, txt);
-    }
+ * Readers compare it with the actual owner to know, without asking the
+ * owner, whether our private targets are worth asking for. A stale
+ * value, left by an owner that since lost the selection, never matches.
+ */
+static xcb_atom_t owner_property(xcb_atom_t selection)
+{
+  return selection == PRIMARY ? owner_primary_atom :
+    selection == SECONDARY ? owner_secondary_atom : owner_clipboard_atom;
+}
 
-    xcb_perror(cookie, "cannot set data into property");
-
-    {
-      /* response to event */
-      xcb_selection_notify_event_t res = {
-	.response_type = XCB_SELECTION_NOTIFY,
-	.pad0 = 0,
-	.sequence = 0,
-	.time = XCB_CURRENT_TIME,
-	.requestor = *win,
-	.selection = req_event->selection,
-	.target = req_event->target,
-	.property = *pty
-      };
-
-      cookie = xcb_send_event_checked(xconn, false, req_event->requestor, 0, (char*)&res);
-    }
+/**
+ * @brief Tell readers that xwin owns a selection
+ */
+static void mark_owner(xcb_atom_t selection)
+{
+  xcb_change_property(xconn, XCB_PROP_MODE_REPLACE, root_window(),
+		      owner_property(selection), WINDOW, 32, 1, &xwin);
+}
+
+/**
+ * @brief Largest amount of data that fits in a single ChangeProperty
+ *
+ * Derived from the server's maximum request length, which accounts for
+ * BIG-REQUESTS when the server supports it, less the request header
+ * (and the extended length field BIG-REQUESTS adds to it).
+ */
+static size_t chunk_size()
+{
+  static size_t size = 0;
 
-    xcb_perror(cookie, "cannot set selection notify");
+  if ( size == 0 ) {
+    const size_t max_req = (size_t)xcb_get_maximum_request_length(xconn) * 4;
+    stats.replies++;
+    const size_t header = sizeof(xcb_change_property_request_t) + 4;
 
-    /* if len < XC_CHUNK, then the data was sent all at
-     * once and the transfer is now complete, return 1
-     */
-    return !(len > XC_CHUNK);
+    size = max_req > header ? max_req - header : 0;
+    if ( size < XC_CHUNK )
+      size = XC_CHUNK;
+  }
 
-  case XCLIP_IN_INCR:
-    /* length of current chunk */
+  return size;
+}
 
-    /* ignore non-property events */
-    if ((evt->response_type & ~0x80) != XCB_PROPERTY_NOTIFY)
-      return 0;
+/**
+ * @brief Find out the encoding of the complete selection data
+ *
+ * Data that is not well-formed UTF-8 is taken to be ISO-8859-1, which
+ * is what STRING always meant.
+ */
+static void analyse_data(XClipInData *data)
+{
+  if ( data->analysed )
+    return;
 
-    xcb_property_notify_event_t *notify_event = (xcb_property_notify_event_t *)evt;
+  data->ascii = text_is_ascii(data->data, data->len);
+  data->utf8 = data->ascii || text_is_utf8(data->data, data->len);
+  data->latin1 = data->ascii || !data->utf8;
+  data->analysed = true;
+}
 
-    /* ignore the event unless it's to report that the
-     * property has been deleted
-     */
-    if (notify_event->state != XCB_PROPERTY_NOTIFY)
-      return 0;
+/**
+ * @brief Allocate the buffer for a conversion
+ */
+static char *form_buffer(size_t size)
+{
+  return store_alloc(size);
+}
 
-    /* set the chunk length to the maximum size */
-    chunk_len = XC_CHUNK;
+/**
+ * @brief Get the selection data in a given form, converting it on first use
+ * @param data Selection data being served
+ * @param form Form to get the data in
+ * @param buf Set to the converted data
+ * @param len Set to the length of the converted data
+ *
+ * Conversions are cached, so repeated requests for the same target cost
+ * nothing; forms that turn out identical share one buffer. Data that is
+ * still being read is always served as it is.
+ */
+static void get_form(XClipInData *data, XClipForm form,
+		     const char **buf, size_t *len)
+{
+  if ( form == XCLIP_FORM_RAW || !data->complete ) {
+    *buf = data->data; *len = data->len;
+    return;
+  }
 
-    /* if a chunk length of maximum size would extend
-     * beyond the end ot txt, set the length to be the
-     * remaining length of txt
-     */
-    if ( (*pos + chunk_len) > len )
-      chunk_len = len - *pos;
+  if ( !data->forms[form].ready ) {
+    const char *fbuf = data->data;
+    size_t flen = data->len;
 
-    /* if the start of the chunk is beyond the end of txt,
-     * then we've already sent all the data, so set the
-     * length to be zero
-     */
-    if (*pos > len)
-      chunk_len = 0;
-
-    if (chunk_len) {
-      /* put the chunk into the property */
-      xcb_change_property_checked(xconn,
-			  XCB_PROP_MODE_REPLACE,
-			  *win,
-			  *pty,
-			  STRING,
-			  8,
-			  chunk_len, &txt[*pos]);
-    } else {
-      /* make an empty property to show we've
-       * finished the transfer
+    analyse_data(data);
+
+    switch(form) {
+    case XCLIP_FORM_LATIN1:
+      if ( !data->latin1 ) {
+	char *out = form_buffer(data->len);
+	flen = utf8_to_latin1(data->data, data->len, out, &data->latin1);
+	fbuf = out;
+      }
+      break;
+    case XCLIP_FORM_UTF8:
+      if ( !data->utf8 ) {
+	char *out = form_buffer(data->len * 2);
+	flen = latin1_to_utf8(data->data, data->len, out);
+	fbuf = out;
+      }
+      break;
+    case XCLIP_FORM_TEXT:
+    case XCLIP_FORM_CTEXT:
+      /* ISO-8859-1 is the initial state of COMPOUND_TEXT; anything else
+       * is wrapped in the UTF-8 escape sequences
        */
-      xcb_change_property_checked(xconn,
-			  XCB_PROP_MODE_REPLACE,
-			  *win,
-			  *pty,
-			  STRING,
-			  8,
-			  0, NULL);
+      get_form(data, XCLIP_FORM_LATIN1, &fbuf, &flen);
+      if ( !data->latin1 ) {
+	static const char utf8_start[] = "\x1b%G", utf8_end[] = "\x1b%@";
+	const char *ubuf; size_t ulen;
+	get_form(data, XCLIP_FORM_UTF8, &ubuf, &ulen);
+
+	char *out = form_buffer(ulen + 6);
+	memcpy(out, utf8_start, 3);
+	memcpy(out + 3, ubuf, ulen);
+	memcpy(out + 3 + ulen, utf8_end, 3);
+	fbuf = out; flen = ulen + 6;
+      }
+      break;
+    case XCLIP_FORM_ZSTD:
+#ifdef HAVE_ZSTD
+      fbuf = compress_data(data->data, data->len, &flen);
+#endif
+      break;
+    case XCLIP_FORM_RAW:
+    case XCLIP_FORMS:
+      break;
     }
-    xcb_flush(xconn);
 
-    /* all data has been sent, break out of the loop */
-    if (!chunk_len)
-      *context = XCLIP_IN_NONE;
-
-    *pos += XC_CHUNK;
-
-    /* if chunk_len == 0, we just finished the transfer,
-     * return 1
-     */
-    return !(chunk_len > 0);
-  }
+    data->forms[form].data = fbuf;
+    data->forms[form].len = flen;
+    data->forms[form].ready = true;
   }
 
-  return 0;
+  *buf = data->forms[form].data;
+  *len = data->forms[form].len;
 }
 
-void do_in_string(char *buf, size_t len)
+/**
+ * @brief Check whether a target can be served for the data as it is now
+ *
+ * Data still being read is served as it is, which the compressed
+ * target can't do.
+ */
+static bool target_available(const XClipTarget *target, XClipInData *data)
 {
-  xcb_void_cookie_t cookie = xcb_change_property_checked(xconn,
-							 XCB_PROP_MODE_REPLACE,
-							 xwin,
-							 CUT_BUFFER0,
-							 STRING,
-							 8,
-							 len, buf);
-  xcb_perror(cookie, "unable to set selection into string");
+  return data->complete || target->form != XCLIP_FORM_ZSTD;
 }
 
-void do_in(char *buf, size_t len)
+/**
+ * @brief Find how a conversion target is served
+ * @return The served target, or NULL if we can't convert to it
+ */
+static const XClipTarget *find_target(xcb_atom_t atom, XClipInData *data)
 {
-  int dloop = 0;	/* done loops counter */
+  for (size_t i = 0; i < SERVED_TARGETS; i++)
+    if ( *served_targets[i].atom == atom )
+      return target_available(&served_targets[i], data) ?
+	&served_targets[i] : NULL;
 
-  /* in mode */
-  /* buffer for selection data */
+  return NULL;
+}
 
-  /* take control of the selection so that we receive
-   * SelectionRequest events from other windows
-   */
-  xcb_void_cookie_t cookie = xcb_set_selection_owner_checked(xconn, xwin, sseln, XCB_CURRENT_TIME);
+/**
+ * @brief Property type to use for a target served in a given form
+ */
+static xcb_atom_t form_type(XClipInData *data, XClipForm form, xcb_atom_t target)
+{
+  /* TEXT is not a type; unconverted data goes as STRING, as it always did */
+  if ( form == XCLIP_FORM_RAW && target == text_atom )
+    return STRING;
+
+  if ( form != XCLIP_FORM_TEXT )
+    return target;
+
+  /* TEXT lets the owner choose the encoding */
+  analyse_data(data);
+  const char *buf; size_t len;
+  get_form(data, XCLIP_FORM_LATIN1, &buf, &len);
+  return data->latin1 ? STRING : compound_text_atom;
+}
 
-  xcb_perror(cookie, "cannot set selection owner");
+/**
+ * @brief Take a reference to selection data
+ */
+static XClipInData *data_ref(XClipInData *data)
+{
+  data->refs++;
+  return data;
+}
 
-  /* fork into the background, exit parent process if we
-   * are in silent mode
-   */
-  if (fverb == OSILENT) {
-    pid_t pid;
+/**
+ * @brief Drop a reference to selection data, freeing it with the last
+ *
+ * Only the daemon lets the count drop to zero, and its data is always
+ * allocated by daemon_take() over a mapping of the client's file.
+ */
+static void data_unref(XClipInData *data)
+{
+  if ( --data->refs > 0 )
+    return;
 
-    pid = fork();
-    /* exit the parent process; */
-    if (pid)
-      exit(EXIT_SUCCESS);
+  /* forms share buffers with the data and with each other */
+  for (size_t i = 0; i < XCLIP_FORMS; i++) {
+    const char *buf = data->forms[i].data;
+    bool shared = !data->forms[i].ready || buf == data->data;
+
+    for (size_t j = 0; j < i && !shared; j++)
+      shared = data->forms[j].ready && data->forms[j].data == buf;
+
+    if ( !shared )
+      store_free((char *)buf);
   }
 
-  /* print a message saying what we're waiting for */
-  if (fverb > OSILENT) {
-    if (sloop == 1)
-      fprintf(
-	      stderr,
-	      "Waiting for one selection request.\n"
-	      );
+  if ( data->len )
+    munmap(data->data, data->len);
+  free(data);
+}
 
-    if (sloop  < 1)
-      fprintf(
-	      stderr,
-	      "Waiting for selection requests, Control-C to quit\n"
-	      );
+/**
+ * @brief Send the next chunk of an INCR transfer
+ * @param transfer Transfer to advance
+ * @return true if the terminating empty property was sent
+ */
+static bool send_incr_chunk(XClipTransfer *transfer)
+{
+  XClipInData *data = transfer->data;
+  const char *buf; size_t len;
+  get_form(data, transfer->form, &buf, &len);
 
-    if (sloop  > 1)
-      fprintf(
-	      stderr,
-	      "Waiting for %i selection requests, Control-C to quit\n",
-	      sloop
-	      );
-  }
+  /* set the chunk length to the maximum size, or to the remaining
+   * length of the data; zero if all the data was sent already
+   */
+  size_t chunk_len = 0;
+  if (transfer->pos < len)
+    chunk_len = (len - transfer->pos) > chunk_size() ?
+      chunk_size() : (len - transfer->pos);
 
-  /* Avoid making the current directory in use, in case it will need to be umounted */
-  chdir("/");
-	
-  /* loop and wait for the expected number of
-   * SelectionRequest events
+  /* put the chunk into the property; an empty property shows we've
+   * finished the transfer
    */
-  while (dloop < sloop || sloop < 1) {
-    /* print messages about what we're waiting for
-     * if not in silent mode
-     */
-    if (fverb > OSILENT) {
-      if (sloop  > 1)
-	fprintf(
-		stderr,
-		"  Waiting for selection request %i of %i.\n",
-		dloop + 1,
-		sloop
-		);
-
-      if (sloop == 1)
-	fprintf(
-		stderr,
-		"  Waiting for a selection request.\n"
-		);
-
-      if (sloop  < 1)
-	fprintf(
-		stderr,
-		"  Waiting for selection request number %i\n",
-		dloop + 1
-		);
-    }
+  xcb_void_cookie_t cookie =
+    xcb_change_property(xconn,
+			XCB_PROP_MODE_REPLACE,
+			transfer->requestor,
+			transfer->property,
+			transfer->type,
+			8,
+			chunk_len,
+			chunk_len ? &buf[transfer->pos] : NULL);
+  transfer->seq_first = transfer->seq_last = cookie.sequence;
+
+  transfer->pos += chunk_len;
+  transfer->context = chunk_len ? XCLIP_IN_INCR : XCLIP_IN_NONE;
+  transfer->deadline = chunk_len ? loop_deadline() : 0;
+
+  stats.bytes_out += chunk_len;
+  if ( chunk_len )
+    stats.incr_chunks++;
+
+  return !chunk_len;
+}
 
-    find_internal_atoms();
+/**
+ * @brief Find the INCR transfer for a requestor window and property
+ * @return The transfer, or NULL if there is none in flight
+ */
+static XClipTransfer *find_transfer(xcb_window_t requestor, xcb_atom_t property)
+{
+  for (size_t i = 0; i < transfers_count; i++)
+    if ( transfers[i].requestor == requestor &&
+	 transfers[i].property == property )
+      return &transfers[i];
 
-    /* wait for a SelectionRequest event */
-    XClipInContext context = XCLIP_IN_NONE;
-    unsigned long sel_pos = 0;
-    xcb_window_t cwin;
-    xcb_atom_t pty;
+  return NULL;
+}
 
-    xcb_generic_event_t *event;
-    bool clear = false;
-    while ((event = xcb_wait_for_event(xconn))) {
-      bool finished = doIn_internal_loop(
-			   &cwin,
-			   event,
-			   &pty,
-			   buf,
-			   len,
-			   &sel_pos,
-			   &context
-			   );
-
-      if ( (event->response_type & ~0x80) == XCB_SELECTION_CLEAR )
-	clear = true;
+/**
+ * @brief Find the INCR transfer a request belongs to
+ * @param sequence Full sequence number of the request
+ * @return The transfer, or NULL if the request is not part of one
+ */
+static XClipTransfer *find_transfer_by_sequence(uint32_t sequence)
+{
+  for (size_t i = 0; i < transfers_count; i++)
+    if ( sequence >= transfers[i].seq_first &&
+	 sequence <= transfers[i].seq_last )
+      return &transfers[i];
+
+  return NULL;
+}
+
+/**
+ * @brief Add a new INCR transfer to the table
+ * @return The new transfer, with its cursor at the start of the data
+ */
+static XClipTransfer *add_transfer(xcb_window_t requestor, xcb_atom_t property)
+{
+  XClipTransfer *transfer = find_transfer(requestor, property);
+  if ( transfer != NULL )
+    return transfer;
+
+  if ( transfers_count == transfers_size ) {
+    transfers_size = transfers_size ? transfers_size * 2 : 4;
+    transfers = realloc(transfers, transfers_size * sizeof(XClipTransfer));
+    if ( transfers == NULL ) {
+      perrorf("%s: %s", progname, __FUNCTION__);
+      exit(EXIT_FAILURE);
+    }
+  }
 
-      if ( (context == XCLIP_IN_NONE) && clear)
-	return;
+  transfer = &transfers[transfers_count++];
+  transfer->requestor = requestor;
+  transfer->property = property;
+  transfer->data = NULL;
+  transfer->notify_pending = false;
+  return transfer;
+}
+
+/**
+ * @brief Drop the transfers that are over from the table
+ *
+ * A requestor that didn't take its last chunk by the deadline set with
+ * --timeout is given up on too.
+ */
+static void reap_transfers()
+{
+  const double now = stimeout > 0 ? stats_now() : 0;
+  size_t j = 0;
+
+  for (size_t i = 0; i < transfers_count; i++) {
+    if ( transfers[i].context == XCLIP_IN_INCR && transfers[i].deadline &&
+	 now >= transfers[i].deadline ) {
+      if (fverb == OVERBOSE)
+	fprintf(stderr, "%s: requestor 0x%x stalled, aborting transfer\n",
+		progname, transfers[i].requestor);
+      transfers[i].context = XCLIP_IN_NONE;
+    }
 
-      if (finished)
-	break;
+    if ( transfers[i].context == XCLIP_IN_NONE ) {
+      data_unref(transfers[i].data);
+
+      /* keep the scheduler pointing at the same next transfer */
+      if ( i < transfers_next )
+	transfers_next--;
+      continue;
     }
 
-    dloop++;	/* increment loop counter */
+    transfers[j++] = transfers[i];
   }
+
+  transfers_count = j;
+  if ( transfers_next >= transfers_count )
+    transfers_next = 0;
 }
 
-static void send_selection_request() {
-  /* send a selection request */
-  xcb_void_cookie_t cookie = xcb_convert_selection_checked(xconn, xwin, sseln,
-							   STRING, xclip_out_atom,
-							   XCB_CURRENT_TIME);
-  
-  xcb_perror(cookie, "cannot convert selection");
+/**
+ * @brief The earliest deadline of the transfers in flight
+ * @return The deadline, or 0 if no transfer has one
+ */
+static double transfers_deadline()
+{
+  double deadline = 0;
+
+  for (size_t i = 0; i < transfers_count; i++)
+    if ( transfers[i].context == XCLIP_IN_INCR && transfers[i].deadline &&
+	 (deadline == 0 || transfers[i].deadline < deadline) )
+      deadline = transfers[i].deadline;
+
+  return deadline;
 }
 
-static int handle_convert_selection(xcb_generic_event_t *event, char **txt, size_t *len) {
-  if ((event->response_type & ~0x80) != XCB_SELECTION_NOTIFY)
-    return 0;
-  
-  xcb_get_property_cookie_t cookie = xcb_get_property(xconn, false, xwin,
-						      xclip_out_atom, STRING, 0, 128);
-  xcb_get_property_reply_t *reply = xcb_get_property_reply(xconn, cookie, 0);
-  
-  assert(reply != NULL);
-  
-  if ( reply->type == incr_atom ) {
-    xcb_delete_property(xconn, xwin, xclip_out_atom);
-    xcb_flush(xconn);
-    return -1;
+/**
+ * @brief Convert the selection to a target, into a requestor's property
+ * @param win Requestor window
+ * @param pty Property to put the data in
+ * @param target_atom Target to convert the selection to
+ * @param data Selection data being served
+ * @return pty, or XCB_NONE if we can't convert to the target
+ *
+ * Data too large for a single property starts an INCR transfer, added
+ * to the table waiting for the sequence number of the SelectionNotify.
+ */
+static xcb_atom_t convert_target(xcb_window_t win, xcb_atom_t pty,
+				 xcb_atom_t target_atom, XClipInData *data)
+{
+  if (target_atom == targets_atom) {
+    xcb_atom_t types[SERVED_TARGETS + 2] = { targets_atom, multiple_atom };
+    uint32_t types_count = 2;
+    for (size_t i = 0; i < SERVED_TARGETS; i++)
+      if ( target_available(&served_targets[i], data) )
+	types[types_count++] = *served_targets[i].atom;
+			
+    /* send data all at once (not using INCR) */
+    xcb_change_property(xconn,
+			XCB_PROP_MODE_REPLACE,
+			win,
+			pty,
+			ATOM,
+			32,
+			types_count, types);
+    return pty;
   }
-  
-  assert(reply->format == 8);
-  
-  uint32_t reply_len = xcb_get_property_value_length(reply) * (reply->format / 8);
-  if(reply->bytes_after) {
-    cookie = xcb_get_property(xconn, 0, xwin, xclip_out_atom, reply->type, 0, reply_len);
-    free(reply);
-    reply = xcb_get_property_reply(xconn, cookie, 0);
-    assert(reply != NULL);
+
+  const XClipTarget *target = find_target(target_atom, data);
+  if (target == NULL) {
+    /* we can't convert to this target */
+    return XCB_NONE;
   }
-  *txt = malloc(reply_len);
-  assert(*txt != NULL);
-  
-  memcpy(*txt, xcb_get_property_value(reply), reply_len);
-  *len = reply_len;
-  
-  /* finished with property, delete it */
-  free(reply);
-  xcb_delete_property_checked(xconn, xwin, xclip_out_atom);
-    
-  /* complete contents of selection fetched, return 1 */
-  return 1;
-}
 
-static bool handle_incr_request(xcb_generic_event_t *event, char **txt, size_t *len) {
-  /* To use the INCR method, we basically delete the
-   * property with the selection in it, wait for an
-   * event indicating that the property has been created,
-   * then read it, delete it, etc.
+  /* data that is still being read is served as it is; otherwise
+   * the conversion is computed, or taken from the cache
    */
-    
-  /* make sure that the event is relevant */
-  if ((event->response_type & ~0x80) != XCB_PROPERTY_NOTIFY)
-    return false;
-    
-  xcb_property_notify_event_t *const prop_event = (xcb_property_notify_event_t *)event;
-  /* skip unless the property has a new value */
-  if (prop_event->state != XCB_PROPERTY_NEW_VALUE)
-    return false;
-	
-  xcb_get_property_cookie_t cookie = xcb_get_any_property(xconn, false,
-							  xwin, xclip_out_atom,
-							  0);
-  xcb_get_property_reply_t *reply = xcb_get_property_reply(xconn, cookie, 0);
-    
-  if ( reply->format != 8 ) {
-    /* property does not contain text, delete it
-     * to tell the other X client that we have read
-     * it and to send the next property
-     */
-    xcb_delete_property_checked(xconn, xwin, xclip_out_atom);
-    return false;
-  }
+  const XClipForm form = data->complete ? target->form : XCLIP_FORM_RAW;
+  const xcb_atom_t type = form_type(data, form, target_atom);
+  const char *buf; size_t len;
+  get_form(data, form, &buf, &len);
 
-  if (reply->bytes_after == 0) {
-    /* no more data, exit from loop */
-    xcb_delete_property_checked(xconn, xwin, xclip_out_atom);
-      
-    /* this means that an INCR transfer is now
-     * complete, return true
+  /* when the data is not complete yet we don't know its final size,
+   * so it has to go through INCR
+   */
+  if (!data->complete || len > chunk_size()) {
+    /* the requestor's property deletions drive the INCR transfer,
+     * so we have to listen for them
      */
-    return true;
+    static const uint32_t values[] = { XCB_EVENT_MASK_PROPERTY_CHANGE };
+    xcb_void_cookie_t cookie =
+      xcb_change_window_attributes(xconn, win, XCB_CW_EVENT_MASK, values);
+
+    XClipTransfer *transfer = add_transfer(win, pty);
+    if ( transfer->data != NULL )
+      data_unref(transfer->data);
+    transfer->data = data_ref(data);
+    transfer->pos = 0;
+    transfer->form = form;
+    transfer->type = type;
+    transfer->context = XCLIP_IN_INCR;
+    transfer->seq_first = cookie.sequence;
+    transfer->notify_pending = true;
+    transfer->deadline = loop_deadline();
+
+    /* send INCR response, with a lower bound of the size */
+    const uint32_t incr_len = len > UINT32_MAX ? UINT32_MAX : len;
+    xcb_change_property(xconn,
+			XCB_PROP_MODE_REPLACE,
+			win,
+			pty,
+			incr_atom,
+			32,
+			1, &incr_len);
+  } else {
+    /* send data all at once (not using INCR) */
+    xcb_change_property(xconn,
+			XCB_PROP_MODE_REPLACE,
+			win,
+			pty,
+			type,
+			8,
+			len, buf);
+    stats.bytes_out += len;
   }
 
-  /* if we have come this far, the propery contains
-   * text, we know the size.
-   */
-  cookie = xcb_get_any_property(xconn, false,
-				xwin, xclip_out_atom,
-				reply->bytes_after);
-
-  /* allocate memory to accommodate data in *txt */
-  uint32_t reply_size = xcb_get_property_value_length(reply);
-  *len += reply_size;
-  char *ltxt = realloc(*txt, *len);
-    
-  if ( ltxt == NULL ) {
-    perrorf("%s: %s", progname, __FUNCTION__);
-    exit(EXIT_FAILURE);
-  }
-    
-  /* add data to ltxt */
-  memcpy(&ltxt[*len - reply_size], xcb_get_property_value(reply),
-	 reply_size);
-    
-  *txt = ltxt;
-    
-  /* delete property to get the next item */
-  xcb_delete_property_checked(xconn, xwin, xclip_out_atom);
-  xcb_flush(xconn);
-  return false;
+  return pty;
 }
 
-void do_out_string()
+/**
+ * @brief Tell a requestor its request was answered
+ * @param win Requestor window
+ * @param selection Selection it asked for
+ * @param target Target it asked for
+ * @param time Time of its request
+ * @param pty Property holding the answer, or XCB_NONE if refused
+ */
+static void send_notify(xcb_window_t win, xcb_atom_t selection,
+			xcb_atom_t target, xcb_timestamp_t time, xcb_atom_t pty)
 {
-  char *buf; uint8_t format; uint32_t prop_len;
-  int res = xcb_get_text_property(xconn, xwin, CUT_BUFFER0,
-				  &format, NULL, &prop_len, &buf);
-  
-  if ( res != 0 && format == 8 )
-    fwrite(buf, sizeof(char), prop_len, stdout);
-
-#ifdef VALGRIND_CLEAN
-  free(buf);
-#endif
+  xcb_selection_notify_event_t res = {
+    .response_type = XCB_SELECTION_NOTIFY,
+    .pad0 = 0,
+    .sequence = 0,
+    .time = time,
+    .requestor = win,
+    .selection = selection,
+    .target = target,
+    .property = pty
+  };
+
+  xcb_void_cookie_t cookie = xcb_send_event(xconn, false, win, 0, (char*)&res);
+
+  /* the transfers just started end their first step with it */
+  for (size_t i = 0; i < transfers_count; i++)
+    if ( transfers[i].notify_pending ) {
+      transfers[i].seq_last = cookie.sequence;
+      transfers[i].notify_pending = false;
+    }
 }
 
-void do_out()
+/**
+ * @brief Start reading the target list of a MULTIPLE request
+ * @param req_event The MULTIPLE request
+ * @param data Selection data being served
+ *
+ * The list is fetched without waiting for it: the request is kept in the
+ * table as a transfer until collect_multiples() gets the reply.
+ */
+static void start_multiple(xcb_selection_request_event_t *req_event,
+			   XClipInData *data)
 {
-  char *buf = NULL;	/* buffer for selection data */
-  size_t len = 0;		/* length of sel_buf */
+  xcb_get_property_cookie_t cookie =
+    xcb_get_property(xconn, false, req_event->requestor, req_event->property,
+		     XCB_GET_PROPERTY_TYPE_ANY, 0,
+		     xcb_get_maximum_request_length(xconn));
+
+  XClipTransfer *transfer = add_transfer(req_event->requestor,
+					 req_event->property);
+  if ( transfer->context == XCLIP_IN_MULTIPLE )
+    xcb_discard_reply(xconn, transfer->seq_first);
+  if ( transfer->data != NULL )
+    data_unref(transfer->data);
+  transfer->data = data_ref(data);
+  transfer->context = XCLIP_IN_MULTIPLE;
+  transfer->seq_first = transfer->seq_last = cookie.sequence;
+  transfer->deadline = 0;
+  transfer->selection = req_event->selection;
+  transfer->time = req_event->time;
+}
 
-  find_internal_atoms();
-  
-  send_selection_request();
-  
-  xcb_generic_event_t *event;
-  XClipOutContext context = XCLIP_OUT_SENTCONVSEL;
-  while ((event = xcb_wait_for_event(xconn))) {
-    switch(context) {
-    case XCLIP_OUT_SENTCONVSEL:
-      switch(handle_convert_selection(event, &buf, &len)) {
-      case -1:
-	context = XCLIP_OUT_INCR;
-      case 0:
-	continue;
-      case 1:
-	  goto done;
-      }
-      break;
-    case XCLIP_OUT_INCR:
-	if ( handle_incr_request(event, &buf, &len) )
-	  goto done;
-	break;
+/**
+ * @brief Convert the selection to every target a MULTIPLE request lists
+ * @param request The MULTIPLE request, as kept in the table
+ * @param reply Its target list, or NULL if it can't be read
+ *
+ * Each pair is converted like a request of its own, INCR included; the
+ * ones we can't convert get their property replaced by None, and the
+ * list is written back for the requestor to tell them apart. A single
+ * SelectionNotify then answers all of them.
+ */
+static void convert_multiple(const XClipTransfer *request,
+			     xcb_get_property_reply_t *reply)
+{
+  const xcb_window_t win = request->requestor;
+  xcb_atom_t pty = request->property;
+
+  if ( reply == NULL || reply->format != 32 ) {
+    pty = XCB_NONE;
+  } else {
+    xcb_atom_t *pairs = xcb_get_property_value(reply);
+    const size_t count = xcb_get_property_value_length(reply) / sizeof(xcb_atom_t) / 2 * 2;
+
+    for (size_t i = 0; i < count; i += 2) {
+      /* MULTIPLE within MULTIPLE is not a thing */
+      if ( pairs[i] == multiple_atom || pairs[i + 1] == XCB_NONE )
+	pairs[i + 1] = XCB_NONE;
+      else
+	pairs[i + 1] = convert_target(win, pairs[i + 1], pairs[i],
+				      request->data);
     }
+
+    xcb_change_property(xconn,
+			XCB_PROP_MODE_REPLACE,
+			win,
+			pty,
+			reply->type,
+			32,
+			count, pairs);
   }
-  
-  /* if we reach here, event was NULL, and something bad happened */
-  assert(event != NULL);
 
- done:
-  fwrite(buf, sizeof(char), len, stdout);
+  send_notify(win, request->selection, multiple_atom, request->time, pty);
+}
+
+/**
+ * @brief Answer the MULTIPLE requests whose target list came in
+ * @return Whether any was answered
+ *
+ * The table is swept newest first: replies come in order, so one pulled
+ * in while polling for a newer request is still found for the older.
+ */
+static bool collect_multiples()
+{
+  bool progress = false;
+
+  for (size_t i = transfers_count; i > 0; i--) {
+    if ( transfers[i - 1].context != XCLIP_IN_MULTIPLE )
+      continue;
+
+    xcb_get_property_reply_t *reply = NULL;
+    xcb_generic_error_t *error = NULL;
+    if ( !xcb_poll_for_reply(xconn, transfers[i - 1].seq_first,
+			     (void **)&reply, &error) )
+      continue;
+    stats.replies++;
+    free(error);
+
+    /* converting the targets can add transfers, moving the table; the
+     * request is dropped with the next reap_transfers()
+     */
+    const XClipTransfer request = transfers[i - 1];
+    transfers[i - 1].context = XCLIP_IN_NONE;
+    convert_multiple(&request, reply);
+    free(reply);
+    progress = true;
+  }
+
+  return progress;
+}
+
+/**
+ * @brief Answer a SelectionRequest event from another window
+ * @param req_event The request to answer
+ * @param data Selection data being served
+ * @param accept Whether new transfers are accepted, or have to be refused
+ *
+ * Requests that fit in a single property are answered right away; larger
+ * ones start an INCR transfer and are added to the table, where the
+ * scheduler takes care of them. A MULTIPLE request is answered once its
+ * target list is read, see collect_multiples(). None of the requests is
+ * checked: errors come back as events and are matched to the transfer
+ * by sequence number.
+ */
+static void serve_request(xcb_selection_request_event_t *req_event,
+			  XClipInData *data, bool accept)
+{
+  xcb_window_t win = req_event->requestor;
+  xcb_atom_t pty = req_event->property;
+
+  /* obsolete requestors leave the property to us */
+  if ( pty == XCB_NONE )
+    pty = req_event->target;
+
+  if (!accept) {
+    /* refuse the conversion */
+    pty = XCB_NONE;
+  } else if (req_event->target == multiple_atom) {
+    /* the list of targets has to be somewhere */
+    if ( req_event->property != XCB_NONE ) {
+      start_multiple(req_event, data);
+      return;
+    }
+    pty = XCB_NONE;
+  } else
+    pty = convert_target(win, pty, req_event->target, data);
+
+  send_notify(win, req_event->selection, req_event->target, req_event->time,
+	      pty);
+}
+
+/**
+ * @brief The next event to serve
+ * @return The event, or NULL if there is none for now
+ *
+ * MULTIPLE requests are answered as their target list comes in, between
+ * the events. Polling for the lists can read more events off the
+ * connection, which poll() would not see, so XCB's queue is taken too.
+ */
+static xcb_generic_event_t *next_in_event()
+{
+  xcb_generic_event_t *event;
+
+  do {
+    if ((event = xcb_poll_for_event(xconn)))
+      return event;
+  } while (collect_multiples());
+
+  return xcb_poll_for_queued_event(xconn);
+}
+
+/**
+ * @brief Dispatch an event to the transfer it relates to
+ * @param evt Event received from the X server
+ * @param data Selection data being served
+ * @param accept Whether new transfers are accepted
+ */
+static void handle_in_event(xcb_generic_event_t *evt, XClipInData *data,
+			    bool accept)
+{
+  switch (evt->response_type & ~0x80) {
+  case 0: {
+    /* an unchecked request failed, most likely because the requestor
+     * went away; give up on the transfer it belongs to
+     */
+    xcb_generic_error_t *error = (xcb_generic_error_t *)evt;
+    XClipTransfer *transfer = find_transfer_by_sequence(error->full_sequence);
+
+    stats.errors++;
+
+    if (fverb == OVERBOSE)
+      fprintf(stderr, "%s: X error %d on request %u%s\n", progname,
+	      error->error_code, error->full_sequence,
+	      transfer ? ", aborting transfer" : "");
+
+    if ( transfer != NULL )
+      transfer->context = XCLIP_IN_NONE;
+    return;
+  }
+
+  case XCB_SELECTION_REQUEST:
+    serve_request((xcb_selection_request_event_t *)evt, data, accept);
+    return;
+
+  case XCB_PROPERTY_NOTIFY: {
+    xcb_property_notify_event_t *notify_event = (xcb_property_notify_event_t *)evt;
+
+    /* ignore the event unless it's to report that the
+     * property of a transfer has been deleted
+     */
+    if (notify_event->state != XCB_PROPERTY_DELETE)
+      return;
+
+    XClipTransfer *transfer = find_transfer(notify_event->window,
+					    notify_event->atom);
+    if ( transfer == NULL || transfer->context != XCLIP_IN_INCR )
+      return;
+
+    /* leave the actual sending to the scheduler */
+    transfer->context = XCLIP_IN_INCR_READY;
+    return;
+  }
+  }
+}
+
+/**
+ * @brief Send the next chunk of every INCR transfer that is due one
+ *
+ * Each pass gives at most one chunk to every transfer, starting from
+ * where the previous pass left off, so that a huge transfer can't starve
+ * the others. Transfers that caught up with a streaming input are put
+ * to sleep until more data is available.
+ */
+static void schedule_transfers()
+{
+  const size_t count = transfers_count;
+
+  for (size_t n = 0; n < count; n++) {
+    XClipTransfer *transfer = &transfers[(transfers_next + n) % count];
+    const XClipInData *data = transfer->data;
+
+    /* a reader waiting for data is woken up when there is some */
+    if ( transfer->context == XCLIP_IN_INCR_WAIT &&
+	 (transfer->pos < data->len || data->complete) )
+      transfer->context = XCLIP_IN_INCR_READY;
+
+    if ( transfer->context != XCLIP_IN_INCR_READY )
+      continue;
+
+    if ( transfer->pos >= data->len && !data->complete ) {
+      transfer->context = XCLIP_IN_INCR_WAIT;
+      continue;
+    }
+
+    send_incr_chunk(transfer);
+  }
+
+  if ( count )
+    transfers_next = (transfers_next + 1) % count;
+}
+
+/**
+ * @brief Rotate the ring of cut buffers
+ * @param rotate Positions to rotate by: CUT_BUFFER0 becomes
+ *        CUT_BUFFER<rotate>, modulo 8
+ * @return The cookie of the rotation, to be checked
+ *
+ * The server refuses to rotate properties that don't exist, so the
+ * buffers are created empty first if missing; appending nothing leaves
+ * the existing ones alone.
+ */
+static xcb_void_cookie_t rotate_cut_buffers(int rotate)
+{
+  const xcb_atom_t buffers[] = {
+    CUT_BUFFER0, CUT_BUFFER1, CUT_BUFFER2, CUT_BUFFER3,
+    CUT_BUFFER4, CUT_BUFFER5, CUT_BUFFER6, CUT_BUFFER7
+  };
+
+  for (size_t i = 0; i < sizeof(buffers)/sizeof(buffers[0]); i++)
+    xcb_change_property(xconn, XCB_PROP_MODE_APPEND, root_window(),
+			buffers[i], STRING, 8, 0, NULL);
+
+  return xcb_rotate_properties_checked(xconn, root_window(),
+				       sizeof(buffers)/sizeof(buffers[0]),
+				       rotate, buffers);
+}
+
+/**
+ * @brief Store data in the first cut buffer, on the root window
+ * @param buf Data to store
+ * @param len Length of data
+ * @param rotate Positions to rotate the ring of cut buffers by first,
+ *        keeping the previous contents, or 0
+ *
+ * The data outlives the process, without forking a background owner.
+ * Data larger than a request goes in a series of appended chunks, all
+ * sent at once and checked with a single round trip at the end.
+ */
+void do_in_string(char *buf, size_t len, int rotate)
+{
+  xcb_void_cookie_t rotate_cookie = { 0 };
+  if ( rotate != 0 )
+    rotate_cookie = rotate_cut_buffers(rotate);
+
+  const size_t chunk = chunk_size();
+  const size_t count = len ? (len + chunk - 1) / chunk : 1;
+
+  xcb_void_cookie_t *cookies = calloc(count, sizeof(xcb_void_cookie_t));
+  if ( cookies == NULL ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    const size_t pos = i * chunk;
+    const size_t chunk_len = len - pos > chunk ? chunk : len - pos;
+
+    cookies[i] = xcb_change_property_checked(xconn,
+					     i ? XCB_PROP_MODE_APPEND : XCB_PROP_MODE_REPLACE,
+					     root_window(),
+					     CUT_BUFFER0,
+					     STRING,
+					     8,
+					     chunk_len, buf + pos);
+  }
+  report_setup_time();
+
+  /* checking the last request waits for all of them */
+  for (size_t i = count; i > 0; i--)
+    xcb_perror(cookies[i - 1], "unable to set selection into string");
+  if ( rotate != 0 )
+    xcb_perror(rotate_cookie, "unable to rotate the cut buffers");
+
+  stats.bytes_out += len;
+  stats.round_trips++;
+  if ( count > 1 )
+    stats.incr_chunks += count;
+
+  free(cookies);
+}
+
+/**
+ * @brief Fork into the background in silent mode
+ *
+ * The parent process exits, returning control to the shell.
+ */
+void go_background()
+{
+  if (fverb == OSILENT) {
+    pid_t pid;
+
+    pid = fork();
+    /* exit the parent process; */
+    if (pid) {
+      stats_print();
+      exit(EXIT_SUCCESS);
+    }
+  }
+}
+
+/**
+ * @brief Take ownership of the selection and get ready to serve it
+ *
+ * Forks into the background in silent mode, so that the parent process
+ * can return control to the shell.
+ */
+static void take_selection()
+{
+  /* take control of the selection so that we receive
+   * SelectionRequest events from other windows
+   */
+  xcb_void_cookie_t cookie = xcb_set_selection_owner_checked(xconn, xwin, sseln, XCB_CURRENT_TIME);
+
+  /* atoms, window and ownership are all settled by one round trip */
+  find_internal_atoms();
+  check_window();
+  xcb_perror(cookie, "cannot set selection owner");
+  stats.round_trips++;
+  mark_owner(sseln);
+
+  report_setup_time();
+
+  /* fork into the background, exit parent process if we
+   * are in silent mode
+   */
+  go_background();
+
+  /* print a message saying what we're waiting for */
+  if (fverb > OSILENT) {
+    if (sloop == 1)
+      fprintf(
+	      stderr,
+	      "Waiting for one selection request.\n"
+	      );
+
+    if (sloop  < 1)
+      fprintf(
+	      stderr,
+	      "Waiting for selection requests, Control-C to quit\n"
+	      );
+
+    if (sloop  > 1)
+      fprintf(
+	      stderr,
+	      "Waiting for %i selection requests, Control-C to quit\n",
+	      sloop
+	      );
+  }
+
+  /* Avoid making the current directory in use, in case it will need to be umounted */
+  chdir("/");
+}
+
+/**
+ * @brief Read more selection data from a streaming input
+ * @param fd File descriptor to read from
+ * @param data Selection data to append to
+ * @param size Allocated size of the data buffer
+ */
+static void read_stream(int fd, XClipInData *data, size_t *size)
+{
+  if ( *size - data->len < XC_CHUNK ) {
+    /* double the allocated size of the buffer */
+    *size = *size ? *size * 2 : XC_CHUNK * 4;
+    data->data = store_realloc(data->data, *size);
+  }
+
+  ssize_t rd = read(fd, data->data + data->len, *size - data->len);
+  if ( rd < 0 && (errno == EAGAIN || errno == EINTR) )
+    return;
+
+  if ( rd > 0 ) {
+    if (ffilt)
+      fwrite(data->data + data->len, sizeof(char), rd, stdout);
+    data->len += rd;
+    stats.bytes_in += rd;
+  } else {
+    data->complete = true;
+    if (ffilt)
+      fclose(stdout);
+  }
+}
+
+/** Input read by serve_selection() while the selection is served */
+typedef struct {
+  XClipInData *data;     /**< selection data to append to */
+  size_t size;           /**< allocated size of the data buffer */
+} XClipStream;
+
+/**
+ * @brief Read from a streaming input once it's ready
+ */
+static void stream_ready(int fd, short revents, void *arg)
+{
+  XClipStream *stream = arg;
+
+  read_stream(fd, stream->data, &stream->size);
+  if ( stream->data->complete )
+    loop_unwatch_fd(fd);
+}
+
+/**
+ * @brief Serve the selection until enough requests were answered
+ * @param data Selection data to serve
+ * @param fd File descriptor the data is still being read from, or -1
+ *
+ * Any number of requestors is served at once: small requests are
+ * answered as soon as they arrive, INCR transfers are kept in a table
+ * and advanced by schedule_transfers(). Once the requested number of
+ * transfers was accepted, or the selection was lost, new requests are
+ * refused and the function returns when the ones in flight are over.
+ */
+static void serve_selection(XClipInData *data, int fd)
+{
+  int accepted = 0;	/* transfers accepted so far */
+  bool clear = false;	/* selection was taken by someone else */
+  XClipStream stream = { data, 0 };
+  const double serve_start = stats_now();
+
+  if ( fd >= 0 ) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    loop_watch_fd(fd, POLLIN, stream_ready, &stream);
+  }
+
+  while (true) {
+    const bool accept = !clear && (sloop < 1 || accepted < sloop);
+
+    /* process whatever XCB already queued, poll() would not see it */
+    xcb_generic_event_t *event;
+    while ((event = next_in_event())) {
+      const uint8_t type = event->response_type & ~0x80;
+
+      stats.events++;
+
+      if ( type == XCB_SELECTION_CLEAR )
+	clear = true;
+
+      /* a TARGETS query is only the prelude to a transfer, and
+       * targets we can't convert to are refused right away; MULTIPLE
+       * counts as one transfer, however many targets it lists
+       */
+      const xcb_atom_t target = type == XCB_SELECTION_REQUEST ?
+	((xcb_selection_request_event_t *)event)->target : XCB_NONE;
+      if ( accept && target != XCB_NONE &&
+	   (target == multiple_atom || find_target(target, data)) ) {
+	accepted++;
+
+	/* print messages about what we're serving if not in
+	 * silent mode
+	 */
+	if (fverb > OSILENT) {
+	  if (sloop  > 1)
+	    fprintf(stderr, "  Serving selection request %i of %i.\n",
+		    accepted, sloop);
+	  else
+	    fprintf(stderr, "  Serving selection request number %i\n",
+		    accepted);
+	}
+      }
+
+      handle_in_event(event, data, accept);
+      free(event);
+    }
+
+    if ( xcb_connection_has_error(xconn) ) {
+      fprintf(stderr, "%s: connection to X server lost\n", progname);
+      exit(EXIT_FAILURE);
+    }
+
+    schedule_transfers();
+    reap_transfers();
+
+    /* everything produced by this round goes out at once */
+    xcb_flush(xconn);
+
+    /* done when no more transfers are accepted and all the
+     * accepted ones are over
+     */
+    if ( transfers_count == 0 &&
+	 (clear || (sloop > 0 && accepted >= sloop)) ) {
+      if ( fd >= 0 )
+	loop_unwatch_fd(fd);
+      stats_add_time(XCBCLIP_PHASE_SERVE, serve_start);
+      return;
+    }
+
+    /* the input is read from within the wait; stalled requestors are
+     * dropped by reap_transfers() once it times out
+     */
+    loop_wait(transfers_deadline());
+  }
+}
+
+void do_in(char *buf, size_t len)
+{
+  XClipInData data = { .data = buf, .len = len, .complete = true, .refs = 1 };
+
+  create_window();
+  intern_internal_atoms();
+  take_selection();
+  serve_selection(&data, -1);
+}
+
+/**
+ * @brief Serve the selection while its data is still being read
+ * @param fd File descriptor to read the selection data from
+ *
+ * Ownership is taken right away; requestors are served through INCR
+ * from whatever was read so far, and the transfer is terminated only
+ * once fd reaches end of file. A requestor that catches up with the
+ * input waits until more data is available.
+ */
+void do_in_stream(int fd)
+{
+  XClipInData data = { .data = NULL, .len = 0, .complete = false, .refs = 1 };
+
+  create_window();
+  intern_internal_atoms();
+  take_selection();
+  serve_selection(&data, fd);
+}
+
+/** A selection the daemon can own, with the data it serves for it */
+typedef struct {
+  char name;             /**< selection as given to --selection */
+  xcb_atom_t atom;
+  XClipInData *data;     /**< NULL while not owned */
+} XClipOwned;
+
+static XClipOwned daemon_selections[3];
+
+#define DAEMON_SELECTIONS (sizeof(daemon_selections)/sizeof(daemon_selections[0]))
+
+/** Set by the signal handler to stop the daemon */
+static volatile sig_atomic_t daemon_quit = 0;
+
+/** Pipe the signal handler wakes the loop up with */
+static int daemon_wake[2];
+
+/**
+ * @brief Stop the daemon once the loop is back from its wait
+ *
+ * The flag alone would be missed by a signal that comes in between its
+ * check and the wait, which could then last until the next event; the
+ * byte written to the pipe ends that wait too.
+ */
+static void daemon_signal(int sig)
+{
+  const int saved_errno = errno;
+
+  daemon_quit = 1;
+  while ( write(daemon_wake[1], "", 1) < 0 && errno == EINTR );
+
+  errno = saved_errno;
+}
+
+/**
+ * @brief Empty the pipe daemon_signal() wrote to
+ */
+static void daemon_woken(int fd, short revents, void *arg)
+{
+  char drain[16];
+  while ( read(fd, drain, sizeof(drain)) > 0 );
+}
+
+/**
+ * @brief Find the daemon's state for a selection
+ * @return The selection, or NULL if the daemon doesn't handle it
+ */
+static XClipOwned *find_owned(xcb_atom_t atom)
+{
+  for (size_t i = 0; i < DAEMON_SELECTIONS; i++)
+    if ( daemon_selections[i].atom == atom )
+      return &daemon_selections[i];
+
+  return NULL;
+}
+
+/**
+ * @brief Take a selection over on behalf of a client
+ * @param name Selection to take, as given to --selection
+ * @param fd File descriptor of the data, closed before returning
+ * @return true if the daemon now owns the selection
+ *
+ * The data is mapped rather than copied: the client sealed it, so it
+ * can't change for as long as the daemon serves it.
+ */
+static bool daemon_take(char name, int fd)
+{
+  XClipOwned *owned = NULL;
+  for (size_t i = 0; i < DAEMON_SELECTIONS; i++)
+    if ( daemon_selections[i].name == name )
+      owned = &daemon_selections[i];
+
+  struct stat st;
+  if ( owned == NULL || fstat(fd, &st) != 0 ) {
+    close(fd);
+    return false;
+  }
+
+  XClipInData *data = calloc(1, sizeof(XClipInData));
+  if ( data == NULL ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  data->len = st.st_size;
+  data->complete = true;
+  data->refs = 1;
+
+  if ( data->len ) {
+    data->data = mmap(NULL, data->len, PROT_READ, MAP_SHARED, fd, 0);
+    if ( data->data == MAP_FAILED ) {
+      close(fd);
+      free(data);
+      return false;
+    }
+  }
+  close(fd);
+
+  xcb_void_cookie_t cookie =
+    xcb_set_selection_owner_checked(xconn, xwin, owned->atom, XCB_CURRENT_TIME);
+  xcb_generic_error_t *error = xcb_request_check(xconn, cookie);
+  stats.replies++; stats.round_trips++;
+  if ( error != NULL ) {
+    free(error);
+    data_unref(data);
+    return false;
+  }
+
+  mark_owner(owned->atom);
+
+  /* transfers of the previous data keep it alive until they're over */
+  if ( owned->data != NULL )
+    data_unref(owned->data);
+  owned->data = data;
+
+  history_add(data->data, data->len);
+
+  stats.bytes_in += data->len;
+  if (fverb > OSILENT)
+    fprintf(stderr, "Took selection %c for a client (%zu bytes)\n",
+	    name, data->len);
+
+  return true;
+}
+
+/**
+ * @brief Forget a selection another client took from the daemon
+ *
+ * The event might predate a handoff that took the selection back, so
+ * the owner is checked before dropping the data.
+ */
+static void daemon_clear(xcb_selection_clear_event_t *event)
+{
+  XClipOwned *owned = find_owned(event->selection);
+  if ( owned == NULL || owned->data == NULL )
+    return;
+
+  xcb_get_selection_owner_reply_t *reply =
+    xcb_get_selection_owner_reply(xconn,
+				  xcb_get_selection_owner(xconn, owned->atom),
+				  NULL);
+  stats.replies++; stats.round_trips++;
+
+  const bool lost = reply == NULL || reply->owner != xwin;
+  free(reply);
+  if ( !lost )
+    return;
+
+  data_unref(owned->data);
+  owned->data = NULL;
+
+  if (fverb > OSILENT)
+    fprintf(stderr, "Lost selection %c\n", owned->name);
+}
+
+/**
+ * @brief Answer the request of a client, once it arrived
+ *
+ * Clients connect only once their data is ready, and send their
+ * request in one go; one that closes the connection without sending
+ * it is answered with a failure.
+ */
+static void daemon_client(int sock, short revents, void *arg)
+{
+  XcbClipDaemonRequest request;
+
+  if ( !daemon_receive(sock, &request) ) {
+    /* woken up for an earlier connection with the same descriptor */
+    if ( errno == EAGAIN )
+      return;
+    daemon_reply(sock, false, -1);
+  }
+  else if ( request.op == XCBCLIP_DAEMON_TAKE )
+    daemon_reply(sock, daemon_take(request.selection, request.fd), -1);
+  else {
+    /* history entries are read without any X request at all */
+    const int fd = history_open(request.index);
+    daemon_reply(sock, fd >= 0, fd);
+    if ( fd >= 0 )
+      close(fd);
+  }
+
+  loop_unwatch_fd(sock);
+  close(sock);
+}
+
+/**
+ * @brief Accept the clients waiting on the daemon socket
+ *
+ * Their requests are waited for by the loop, along with the X events,
+ * so that a slow client doesn't hold up the selections being served.
+ */
+static void daemon_accept(int listen_fd, short revents, void *arg)
+{
+  int sock;
+  while ((sock = accept4(listen_fd, NULL, NULL,
+			 SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)
+    loop_watch_fd(sock, POLLIN, daemon_client, NULL);
+}
+
+/**
+ * @brief Serve selections handed over by other xcbclip processes
+ * @param listen_fd Socket to accept the handoffs from
+ * @param history Number of selections to keep in the history, or 0
+ * @param history_size Most bytes of data to keep in the history
+ *
+ * A single connection and window serve all the selections, for as long
+ * as the daemon runs; clients only pass the data along, so they neither
+ * connect to the X server nor stay around to serve it.
+ */
+void do_daemon(int listen_fd, unsigned int history, size_t history_size)
+{
+  if ( history )
+    history_init(history, history_size);
+
+  create_window();
+  intern_internal_atoms();
+  find_internal_atoms();
+  check_window();
+  report_setup_time();
+
+  daemon_selections[0] = (XClipOwned){ 'p', PRIMARY, NULL };
+  daemon_selections[1] = (XClipOwned){ 's', SECONDARY, NULL };
+  daemon_selections[2] = (XClipOwned){ 'c', clipboard_atom, NULL };
+
+  go_background();
+
+  /* only the process that keeps running removes the socket */
+  atexit(daemon_unlink);
+
+  if ( pipe(daemon_wake) != 0 ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < 2; i++)
+    fcntl(daemon_wake[i], F_SETFL, fcntl(daemon_wake[i], F_GETFL) | O_NONBLOCK);
+  loop_watch_fd(daemon_wake[0], POLLIN, daemon_woken, NULL);
+
+  struct sigaction action = { .sa_handler = daemon_signal };
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGHUP, &action, NULL);
+
+  if (fverb > OSILENT)
+    fprintf(stderr, "Waiting for selections to serve, Control-C to quit\n");
+
+  chdir("/");
+
+  const double serve_start = stats_now();
+  loop_watch_fd(listen_fd, POLLIN, daemon_accept, NULL);
+
+  while (!daemon_quit) {
+    xcb_generic_event_t *event;
+    while ((event = next_in_event())) {
+      const uint8_t type = event->response_type & ~0x80;
+      XClipInData *data = NULL;
+
+      stats.events++;
+
+      if ( type == XCB_SELECTION_CLEAR )
+	daemon_clear((xcb_selection_clear_event_t *)event);
+
+      if ( type == XCB_SELECTION_REQUEST ) {
+	XClipOwned *owned =
+	  find_owned(((xcb_selection_request_event_t *)event)->selection);
+	data = owned ? owned->data : NULL;
+      }
+
+      handle_in_event(event, data, data != NULL);
+      free(event);
+    }
+
+    if ( xcb_connection_has_error(xconn) ) {
+      fprintf(stderr, "%s: connection to X server lost\n", progname);
+      exit(EXIT_FAILURE);
+    }
+
+    schedule_transfers();
+    reap_transfers();
+
+    /* handoffs are answered from within the wait, and a signal ends it,
+     * even one that came in before it started
+     */
+    loop_wait(transfers_deadline());
+  }
+
+  stats_add_time(XCBCLIP_PHASE_SERVE, serve_start);
+  loop_unwatch_fd(listen_fd);
+  loop_unwatch_fd(daemon_wake[0]);
+  close(listen_fd);
+  close(daemon_wake[0]);
+  close(daemon_wake[1]);
+  daemon_unlink();
+}
+
+/** A conversion of a selection being read */
+typedef struct {
+  xcb_atom_t selection;
+  xcb_atom_t target;     /**< target asked of the owner */
+  xcb_atom_t property;   /**< property of xwin the owner puts the data in */
+  bool text;             /**< read as text, falling back to older targets */
+  XClipOutContext context;
+  bool done;             /**< the conversion is over */
+  bool refused;          /**< the owner refused every target asked */
+  xcb_atom_t multiple;   /**< property of the MULTIPLE request it's part of */
+
+  /** the data is kept for a record rather than written out as it comes */
+  bool buffered;
+  char *buf;
+  size_t len;
+  size_t size;
+  xcb_atom_t type;       /**< type of the property the data came from */
+} XClipRead;
+
+/**
+ * @brief Ask the owner to convert the selection
+ * @param read Conversion the request is for
+ * @param target Target to convert the selection to
+ */
+static void send_selection_request(XClipRead *read, xcb_atom_t target) {
+  read->target = target;
+  read->context = XCLIP_OUT_SENTCONVSEL;
+  xcb_convert_selection(xconn, xwin, read->selection,
+			target, read->property,
+			XCB_CURRENT_TIME);
+}
+
+/**
+ * @brief Check whether another xcbclip owns a selection
+ *
+ * The owner and the property mark_owner() set are asked for together,
+ * in a single round trip that only involves the server: owners that
+ * would just refuse our private targets are never asked for them.
+ */
+static bool owned_by_xcbclip(xcb_atom_t selection)
+{
+  xcb_get_selection_owner_cookie_t owner_cookie =
+    xcb_get_selection_owner(xconn, selection);
+  xcb_get_property_cookie_t marker_cookie =
+    xcb_get_property(xconn, false, root_window(), owner_property(selection),
+		     WINDOW, 0, 1);
+
+  xcb_get_selection_owner_reply_t *owner =
+    xcb_get_selection_owner_reply(xconn, owner_cookie, NULL);
+  xcb_get_property_reply_t *marker =
+    xcb_get_property_reply(xconn, marker_cookie, NULL);
+  stats.replies += 2; stats.round_trips++;
+
+  const bool xcbclip = owner != NULL && owner->owner != XCB_NONE &&
+    marker != NULL && marker->format == 32 &&
+    xcb_get_property_value_length(marker) == sizeof(xcb_window_t) &&
+    *(xcb_window_t *)xcb_get_property_value(marker) == owner->owner;
+
+  free(owner);
+  free(marker);
+  return xcbclip;
+}
+
+/**
+ * @brief First target to ask for when reading a selection as text
+ *
+ * Another xcbclip owner sends the data exactly as it was given to it,
+ * even when it's not text at all, and compressed when both ends can,
+ * saving most of the traffic and INCR round trips. Any other owner is
+ * asked for UTF-8.
+ */
+static xcb_atom_t text_target(xcb_atom_t selection)
+{
+  if ( !owned_by_xcbclip(selection) )
+    return utf8_string_atom;
+
+#ifdef HAVE_ZSTD
+  return zstd_atom;
+#else
+  return raw_atom;
+#endif
+}
+
+/**
+ * @brief Start reading a selection
+ *
+ * Text is asked for in the best target the owner can serve, found by
+ * text_target(); the targets it refuses are replaced by the next best ones by
+ * handle_convert_selection(). Other targets are asked for as they are.
+ */
+static void request_selection(XClipRead *read)
+{
+  read->done = read->refused = false;
+  read->len = 0;
+
+  if ( !read->text ) {
+    send_selection_request(read, read->target);
+    return;
+  }
+
+  send_selection_request(read, text_target(read->selection));
+}
+
+/**
+ * @brief Start reading several conversions of a selection at once
+ * @param reads Conversions being read
+ * @param count Number of conversions
+ * @param selection Selection whose conversions are asked for
+ * @param pty Property to put the list of target and property pairs in
+ *
+ * The owner gets a single MULTIPLE request and answers it with a single
+ * SelectionNotify, rather than one for each target.
+ */
+static void request_multiple(XClipRead *reads, size_t count,
+			     xcb_atom_t selection, xcb_atom_t pty)
+{
+  xcb_atom_t *pairs = calloc(count * 2, sizeof(xcb_atom_t));
+  if ( pairs == NULL ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  const xcb_atom_t text = text_target(selection);
+
+  size_t pairs_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    XClipRead *read = &reads[i];
+    if ( read->selection != selection )
+      continue;
+
+    read->done = read->refused = false;
+    read->len = 0;
+    read->multiple = pty;
+    read->context = XCLIP_OUT_SENTCONVSEL;
+    if ( read->text )
+      read->target = text;
+
+    pairs[2 * pairs_count] = read->target;
+    pairs[2 * pairs_count + 1] = read->property;
+    pairs_count++;
+  }
+
+  xcb_change_property(xconn, XCB_PROP_MODE_REPLACE, xwin, pty,
+		      atom_pair_atom, 32, pairs_count * 2, pairs);
+  xcb_convert_selection(xconn, xwin, selection, multiple_atom, pty,
+			XCB_CURRENT_TIME);
+  free(pairs);
+}
+
+/* Standard output is written with writev() straight from the buffers
+ * the data is in, most of all the replies XCB read the properties
+ * into: the pieces are queued along with the replies they point into,
+ * and the replies are freed once the pieces are written out. The only
+ * copy left is the kernel's, into the pipe or file.
+ */
+
+/** Most pieces of output written by a single writev() */
+#define XC_OUT_PIECES 16
+
+/** Pieces of output queued for the next writev() */
+static struct iovec out_pieces[XC_OUT_PIECES];
+/** Replies the pieces point into, or NULL, freed once written */
+static void *out_replies[XC_OUT_PIECES];
+static int out_count = 0;
+
+/**
+ * @brief Write out all the queued pieces of output
+ */
+static void flush_output()
+{
+  const double start = stats_now();
+  struct iovec *iov = out_pieces;
+  int iovcnt = out_count;
+
+  while ( iovcnt > 0 ) {
+    ssize_t wr = writev(STDOUT_FILENO, iov, iovcnt);
+    if ( wr < 0 && errno == EINTR )
+      continue;
+    if ( wr < 0 && errno == EAGAIN ) {
+      /* standard output was left non-blocking by whoever set it up */
+      struct pollfd pfd = { .fd = STDOUT_FILENO, .events = POLLOUT };
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    if ( wr < 0 ) {
+      perrorf("%s: %s", progname, __FUNCTION__);
+      exit(EXIT_FAILURE);
+    }
+
+    stats.bytes_out += wr;
+
+    /* skip the pieces written whole, and what was written of the next */
+    for (; iovcnt > 0 && (size_t)wr >= iov->iov_len; iov++, iovcnt--)
+      wr -= iov->iov_len;
+    if ( iovcnt > 0 ) {
+      iov->iov_base = (char *)iov->iov_base + wr;
+      iov->iov_len -= wr;
+    }
+  }
+
+  for (int i = 0; i < out_count; i++)
+    free(out_replies[i]);
+  out_count = 0;
+
+  stats_add_time(XCBCLIP_PHASE_WRITE, start);
+}
+
+/**
+ * @brief Queue a piece of output
+ * @param data Data to write
+ * @param len Length of data
+ * @param reply Reply data points into, freed once it's written, or NULL
+ *        if data has to stay valid until flush_output()
+ */
+static void queue_output(const void *data, size_t len, void *reply)
+{
+  if ( out_count == XC_OUT_PIECES )
+    flush_output();
+
+  if ( len == 0 ) {
+    free(reply);
+    return;
+  }
+
+  out_pieces[out_count] = (struct iovec){ .iov_base = (void *)data, .iov_len = len };
+  out_replies[out_count++] = reply;
+}
+
+/**
+ * @brief Check whether data read has to be converted from ISO-8859-1
+ * @param read Conversion the data belongs to
+ * @param type Type of the property the data came from
+ *
+ * Only text, whose target we chose, is written out as UTF-8, so STRING
+ * is converted when the owner fell back to it; a target the user asked
+ * for is written out exactly as the owner sent it, STRING included.
+ */
+static bool from_latin1(const XClipRead *read, xcb_atom_t type)
+{
+  return read->text && type == STRING;
+}
+
+/**
+ * @brief Write a chunk of selection data to standard output
+ * @param data Data to write
+ * @param len Length of data
+ * @param latin1 Whether to convert the data from ISO-8859-1 to UTF-8
+ *        first, as told by from_latin1()
+ *
+ * The data is written out, along with anything queued before it,
+ * before returning, so that the caller only asks for the next chunk
+ * once the previous one was accepted downstream.
+ */
+static void write_chunk(const void *data, size_t len, bool latin1)
+{
+  static char *utf8_buf = NULL;
+  static size_t utf8_size = 0;
+
+  if ( latin1 && !text_is_ascii(data, len) ) {
+    if ( len * 2 > utf8_size ) {
+      free(utf8_buf);
+      utf8_size = len * 2;
+      if ( (utf8_buf = malloc(utf8_size)) == NULL ) {
+	perrorf("%s: %s", progname, __FUNCTION__);
+	exit(EXIT_FAILURE);
+      }
+      stats_buffer(utf8_size);
+    }
+
+    len = latin1_to_utf8(data, len, utf8_buf);
+    data = utf8_buf;
+  }
+
+  queue_output(data, len, NULL);
+  flush_output();
+}
+
+#ifdef HAVE_ZSTD
+/**
+ * @brief Write a piece of decompressed selection data, as it is
+ */
+static void write_raw_chunk(const void *data, size_t len)
+{
+  write_chunk(data, len, false);
+}
+#endif
+
+/**
+ * @brief Hand a chunk of selection data to standard output
+ * @param read Conversion the data belongs to
+ * @param data Data received
+ * @param len Length of data
+ * @param type Type of the property the data came from
+ *
+ * Only text is converted to UTF-8; other targets are written as the
+ * owner sent them.
+ */
+static void receive_chunk(XClipRead *read, const void *data, size_t len,
+			  xcb_atom_t type)
+{
+  /* a record is only written once its length is known */
+  if ( read->buffered ) {
+    if ( read->len + len > read->size ) {
+      if ( read->size == 0 )
+	read->size = XC_CHUNK * 4;
+      while ( read->len + len > read->size )
+	read->size *= 2;
+      read->buf = store_realloc(read->buf, read->size);
+    }
+
+    memcpy(read->buf + read->len, data, len);
+    read->len += len;
+    read->type = type;
+    return;
+  }
+
+#ifdef HAVE_ZSTD
+  if ( type == zstd_atom && read->text ) {
+    if ( !decompress_chunk(data, len, write_raw_chunk) ) {
+      fprintf(stderr, "%s: corrupt compressed selection\n", progname);
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+#endif
+
+  write_chunk(data, len, from_latin1(read, type));
+}
+
+/**
+ * @brief Hand a property read by the owner over to standard output
+ * @param read Conversion the property belongs to
+ * @param reply Reply with the property, freed by this function
+ *
+ * Data written out as it is stays in the reply until it's written,
+ * with the next ones read in one go; anything converted, decompressed
+ * or kept for a record goes through receive_chunk().
+ */
+static void receive_reply(XClipRead *read, xcb_get_property_reply_t *reply)
+{
+  const void *data = xcb_get_property_value(reply);
+  const size_t len = xcb_get_property_value_length(reply);
+
+  if ( read->buffered || (read->text && reply->type == zstd_atom) ||
+       (from_latin1(read, reply->type) && !text_is_ascii(data, len)) ) {
+    receive_chunk(read, data, len, reply->type);
+    free(reply);
+    return;
+  }
+
+  queue_output(data, len, reply);
+}
+
+/**
+ * @brief Check that the selection data received was complete
+ */
+static void finish_chunks(XClipRead *read)
+{
+#ifdef HAVE_ZSTD
+  if ( !read->buffered && !decompress_finish(write_raw_chunk) ) {
+    fprintf(stderr, "%s: compressed selection cut short\n", progname);
+    exit(EXIT_FAILURE);
+  }
+#endif
+}
+
+/**
+ * @brief Handle the owner's refusal to convert the selection
+ * @return 1 if the conversion is over, 0 if another target was asked for
+ */
+static int handle_refused(XClipRead *read)
+{
+  /* an xcbclip built without zstd refuses the compressed target, and
+   * owners that predate UTF8_STRING might still convert it to STRING
+   */
+  if ( read->text && read->target == zstd_atom )
+    send_selection_request(read, raw_atom);
+  else if ( read->text && read->target == raw_atom )
+    send_selection_request(read, utf8_string_atom);
+  else if ( read->text && read->target == utf8_string_atom )
+    send_selection_request(read, STRING);
+  else {
+    read->refused = true;
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Ask for the property the owner converted the selection into
+ *
+ * The property is read as a whole, which the server takes as the cue
+ * to delete it: that's how the owner learns that we got the data, or
+ * the next INCR chunk can be sent, without a request of its own. A
+ * property can't be larger than a request, so one is enough unless the
+ * owner appended to it.
+ */
+static xcb_get_property_cookie_t get_converted(XClipRead *read)
+{
+  return xcb_get_property(xconn, true, xwin,
+			  read->property, XCB_GET_PROPERTY_TYPE_ANY, 0,
+			  xcb_get_maximum_request_length(xconn));
+}
+
+/**
+ * @brief Hand a property read by get_converted() over to standard output
+ * @param read Conversion the property belongs to
+ * @param reply Reply to get_converted(), freed by this function
+ *
+ * A property that was appended to past the request size is not deleted
+ * by the first read, so the rest of it is read, and deleted, in one go.
+ */
+static void receive_property(XClipRead *read, xcb_get_property_reply_t *reply)
+{
+  const uint32_t reply_len = xcb_get_property_value_length(reply);
+  const uint32_t bytes_after = reply->bytes_after;
+  const xcb_atom_t type = reply->type;
+  receive_reply(read, reply);
+
+  if ( bytes_after ) {
+    xcb_get_property_cookie_t cookie =
+      xcb_get_property(xconn, true, xwin, read->property, type,
+		       (reply_len + 3) / 4, (bytes_after + 3) / 4);
+    reply = xcb_get_property_reply(xconn, cookie, 0);
+    stats.replies++; stats.round_trips++;
+    assert(reply != NULL);
+
+    receive_reply(read, reply);
+  }
+
+  /* both parts go out in one go */
+  flush_output();
+}
+
+/**
+ * @brief Handle the property the owner converted the selection into
+ * @param read Conversion the property belongs to
+ * @param cookie Request sent by get_converted()
+ * @return 1 once the conversion is over, -1 if it goes on through INCR
+ */
+static int handle_converted(XClipRead *read, xcb_get_property_cookie_t cookie)
+{
+  xcb_get_property_reply_t *reply = xcb_get_property_reply(xconn, cookie, 0);
+  stats.replies++;
+  
+  assert(reply != NULL);
+  
+  /* reading the INCR property deleted it, which starts the transfer */
+  if ( reply->type == incr_atom ) {
+    free(reply);
+    return -1;
+  }
+  
+  /* text comes in 8-bit units, but other targets, like TARGETS, don't */
+  assert(reply->format == 8 || !read->text);
+  
+  receive_property(read, reply);
+  finish_chunks(read);
+    
+  /* complete contents of selection fetched, return 1 */
+  return 1;
+}
+
+/**
+ * @brief Handle the owner's answer to a conversion request
+ * @return 1 once the conversion is over, -1 if it goes on through INCR,
+ *         0 if another target was asked for
+ */
+static int handle_convert_selection(XClipRead *read,
+				    xcb_selection_notify_event_t *event) {
+  if ( event->property == XCB_NONE )
+    return handle_refused(read);
+
+  xcb_get_property_cookie_t cookie = get_converted(read);
+  stats.round_trips++;
+  return handle_converted(read, cookie);
+}
+
+/**
+ * @brief Advance a conversion with the result of handling its answer
+ * @return 1 if the conversion is over, 0 otherwise
+ */
+static size_t conversion_step(XClipRead *read, int res)
+{
+  if ( res == -1 )
+    read->context = XCLIP_OUT_INCR;
+
+  read->done = res == 1;
+  return read->done;
+}
+
+/**
+ * @brief Handle the owner's answer to a MULTIPLE request
+ * @param reads Conversions being read
+ * @param count Number of conversions
+ * @param notify The owner's answer
+ * @return The number of conversions that are over
+ *
+ * The list of pairs and the property of every pair are read in one
+ * round trip. Owners that don't know MULTIPLE refuse it, and each
+ * target is then asked for on its own, like the pairs the owner
+ * refused.
+ */
+static size_t handle_multiple(XClipRead *reads, size_t count,
+			      xcb_selection_notify_event_t *notify)
+{
+  const xcb_atom_t pty = notify->property;
+  xcb_get_property_cookie_t list_cookie = { 0 };
+  xcb_get_property_cookie_t *cookies = calloc(count, sizeof(xcb_get_property_cookie_t));
+  if ( cookies == NULL ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  if ( pty != XCB_NONE ) {
+    list_cookie = xcb_get_property(xconn, true, xwin, pty, XCB_GET_PROPERTY_TYPE_ANY,
+				   0, xcb_get_maximum_request_length(xconn));
+    for (size_t i = 0; i < count; i++)
+      if ( reads[i].multiple == pty )
+	cookies[i] = get_converted(&reads[i]);
+    stats.round_trips++;
+  }
+
+  /* the list of pairs comes back with None for the refused ones; an
+   * owner that didn't understand the request and sent some data for it
+   * doesn't know MULTIPLE either
+   */
+  xcb_get_property_reply_t *list = NULL;
+  const xcb_atom_t *pairs = NULL;
+  size_t pairs_count = 0;
+  bool supported = false;
+  if ( pty != XCB_NONE ) {
+    list = xcb_get_property_reply(xconn, list_cookie, 0);
+    stats.replies++;
+    supported = list != NULL && list->format == 32;
+    if ( supported ) {
+      pairs = xcb_get_property_value(list);
+      pairs_count = xcb_get_property_value_length(list) / sizeof(xcb_atom_t) / 2;
+    }
+  }
+
+  size_t done = 0;
+  for (size_t i = 0, pair = 0; i < count; i++) {
+    XClipRead *read = &reads[i];
+    if ( read->done || read->multiple == XCB_NONE ||
+	 read->selection != notify->selection ||
+	 (pty != XCB_NONE && read->multiple != pty) )
+      continue;
+
+    read->multiple = XCB_NONE;
+
+    if ( !supported ) {
+      if ( pty != XCB_NONE )
+	xcb_discard_reply(xconn, cookies[i].sequence);
+      send_selection_request(read, read->target);
+      continue;
+    }
+
+    if ( pair < pairs_count && pairs[2 * pair + 1] != XCB_NONE )
+      done += conversion_step(read, handle_converted(read, cookies[i]));
+    else {
+      xcb_discard_reply(xconn, cookies[i].sequence);
+      done += conversion_step(read, handle_refused(read));
+    }
+    pair++;
+  }
+
+  free(list);
+  free(cookies);
+  return done;
+}
+
+/**
+ * @brief Read the next chunk of an INCR transfer
+ * @return true once the transfer is over
+ *
+ * The owner puts each chunk in the property once we deleted the
+ * previous one, and an empty property ends the transfer. Each chunk
+ * takes a single request, which reads it and deletes it.
+ */
+static bool handle_incr_request(XClipRead *read,
+				xcb_property_notify_event_t *prop_event) {
+  /* skip unless the property has a new value */
+  if (prop_event->state != XCB_PROPERTY_NEW_VALUE)
+    return false;
+
+  xcb_get_property_reply_t *reply =
+    xcb_get_property_reply(xconn, get_converted(read), 0);
+  stats.replies++; stats.round_trips++;
+  assert(reply != NULL);
+
+  if ( reply->format != 8 && read->text ) {
+    /* property does not contain text; it's only left to delete if it
+     * was too large to be read whole
+     */
+    if ( reply->bytes_after )
+      xcb_delete_property(xconn, xwin, read->property);
+    free(reply);
+    return false;
+  }
+
+  if ( xcb_get_property_value_length(reply) == 0 && reply->bytes_after == 0 ) {
+    /* no more data, the INCR transfer is now complete */
+    free(reply);
+    finish_chunks(read);
+    return true;
+  }
+
+  /* the owner can put the next chunk in the property while this one
+   * is written out, but not the one after it: a slow consumer still
+   * throttles the owner, with at most a chunk waiting in the server
+   */
+  stats.incr_chunks++;
+  receive_property(read, reply);
+  return false;
+}
+
+/**
+ * @brief Advance the reading state machines with an event
+ * @param reads Conversions being read
+ * @param count Number of conversions
+ * @param event Event received from the X server
+ * @return The number of conversions the event completed
+ *
+ * Answers are matched to conversions by selection, target and
+ * property, and INCR chunks by property, which is different for each.
+ */
+static size_t handle_out_event(XClipRead *reads, size_t count,
+			       xcb_generic_event_t *event)
+{
+  if ( event->response_type == 0 ) {
+    /* one of the unchecked requests failed; the only ones we send are
+     * on our own window and properties, so the transfer can't go on
+     */
+    xcb_generic_error_t *error = (xcb_generic_error_t *)event;
+    stats.errors++;
+    fprintf(stderr, "%s: X error %d on request %u\n", progname,
+	    error->error_code, error->full_sequence);
+    exit(EXIT_FAILURE);
+  }
+
+  switch(event->response_type & ~0x80) {
+  case XCB_SELECTION_NOTIFY: {
+    xcb_selection_notify_event_t *notify = (xcb_selection_notify_event_t *)event;
+
+    if ( notify->target == multiple_atom )
+      return handle_multiple(reads, count, notify);
+
+    for (size_t i = 0; i < count; i++) {
+      XClipRead *read = &reads[i];
+      if ( read->done || read->context != XCLIP_OUT_SENTCONVSEL ||
+	   read->multiple != XCB_NONE ||
+	   read->selection != notify->selection ||
+	   read->target != notify->target ||
+	   (notify->property != XCB_NONE && notify->property != read->property) )
+	continue;
+
+      return conversion_step(read, handle_convert_selection(read, notify));
+    }
+    break;
+  }
+  case XCB_PROPERTY_NOTIFY: {
+    xcb_property_notify_event_t *prop_event = (xcb_property_notify_event_t *)event;
+
+    for (size_t i = 0; i < count; i++) {
+      XClipRead *read = &reads[i];
+      if ( read->done || read->context != XCLIP_OUT_INCR ||
+	   read->property != prop_event->atom )
+	continue;
+
+      read->done = handle_incr_request(read, prop_event);
+      return read->done;
+    }
+    break;
+  }
+  }
+
+  return 0;
+}
+
+/** Reads of the cut buffer in flight at once */
+#define XC_CUT_READS 4
+
+/**
+ * @brief Print the first cut buffer
+ * @param rotate Positions to rotate the ring of cut buffers by first,
+ *        or 0
+ *
+ * The buffer is read in chunks as large as a request, a few of them in
+ * flight at once, and written out straight from the replies, a batch
+ * at a time.
+ */
+void do_out_string(int rotate)
+{
+  xcb_void_cookie_t rotate_cookie = { 0 };
+  if ( rotate != 0 )
+    rotate_cookie = rotate_cut_buffers(rotate);
+
+  /* property offsets and lengths are in 32-bit units */
+  const uint32_t chunk = chunk_size() / 4;
+
+  xcb_get_property_cookie_t cookie =
+    xcb_get_property(xconn, false, root_window(), CUT_BUFFER0,
+		     XCB_GET_PROPERTY_TYPE_ANY, 0, chunk);
+  report_setup_time();
+
+  xcb_get_property_reply_t *reply = xcb_get_property_reply(xconn, cookie, 0);
+  stats.replies++; stats.round_trips++;
+  if ( rotate != 0 )
+    xcb_perror(rotate_cookie, "unable to rotate the cut buffers");
+
+  if ( reply == NULL || reply->format != 8 ) {
+    free(reply);
+    return;
+  }
+
+  const xcb_atom_t type = reply->type;
+  const size_t count = (reply->bytes_after + chunk * 4 - 1) / (chunk * 4);
+  queue_output(xcb_get_property_value(reply),
+	       xcb_get_property_value_length(reply), reply);
+
+  xcb_get_property_cookie_t cookies[XC_CUT_READS];
+  for (size_t sent = 0, done = 0; done < count; done++) {
+    for (; sent < count && sent < done + XC_CUT_READS; sent++)
+      cookies[sent % XC_CUT_READS] =
+	xcb_get_property(xconn, false, root_window(), CUT_BUFFER0, type,
+			 (sent + 1) * chunk, chunk);
+
+    reply = xcb_get_property_reply(xconn, cookies[done % XC_CUT_READS], 0);
+    stats.replies++;
+    if ( reply == NULL )
+      break;
+
+    /* the replies of a batch are written out together */
+    queue_output(xcb_get_property_value(reply),
+		 xcb_get_property_value_length(reply), reply);
+    if ( done % XC_CUT_READS == XC_CUT_READS - 1 )
+      flush_output();
+  }
+
+  flush_output();
+
+  if ( count )
+    stats.round_trips += (count + XC_CUT_READS - 1) / XC_CUT_READS;
+}
+
+/**
+ * @brief Get ready to read selections, once the window was created
+ */
+static void setup_out()
+{
+  find_internal_atoms();
+  check_window();
+}
+
+#ifdef HAVE_ZSTD
+/** Record being decompressed by write_record() */
+static XClipRead *record_read;
+
+/**
+ * @brief Keep a piece of a decompressed record
+ */
+static void record_chunk(const void *data, size_t len)
+{
+  receive_chunk(record_read, data, len, raw_atom);
+}
+#endif
+
+/**
+ * @brief Write a conversion read in a batch out as a record
+ * @param read Conversion to write out, once it's over
+ * @param spec Selection and target it was asked for
+ *
+ * A record is a header line with the selection, the target and the
+ * length of the data, followed by the data itself. The length of a
+ * conversion the owner refused is -1, and no data follows.
+ */
+static void write_record(XClipRead *read, const XcbClipReadSpec *spec)
+{
+  const char *const selection = spec->selection == 'c' ? "CLIPBOARD" :
+    spec->selection == 's' ? "SECONDARY" : "PRIMARY";
+  const char *const target = spec->target ? spec->target : "UTF8_STRING";
+
+  /* the header goes out in the same writev() as the data */
+  queue_output(selection, strlen(selection), NULL);
+  queue_output(" ", 1, NULL);
+  queue_output(target, strlen(target), NULL);
+
+  if ( read->refused ) {
+    write_chunk(" -1\n", 4, false);
+    return;
+  }
+
+  /* text is written as UTF-8, like when it's read on its own */
+  XClipRead text = { .buffered = true };
+  const char *data = read->buf;
+  size_t len = read->len;
+
+#ifdef HAVE_ZSTD
+  if ( read->text && read->type == zstd_atom ) {
+    record_read = &text;
+    if ( !decompress_chunk(data, len, record_chunk) ||
+	 !decompress_finish(record_chunk) ) {
+      fprintf(stderr, "%s: corrupt compressed selection\n", progname);
+      exit(EXIT_FAILURE);
+    }
+    data = text.buf; len = text.len;
+  }
+#endif
+
+  if ( from_latin1(read, read->type) && !text_is_ascii(data, len) ) {
+    text.buf = store_alloc(len * 2);
+    len = latin1_to_utf8(data, len, text.buf);
+    data = text.buf;
+  }
+
+  char length[32];
+  queue_output(length, snprintf(length, sizeof(length), " %zu\n", len), NULL);
+  write_chunk(data, len, false);
+
+  store_free(text.buf);
+  store_free(read->buf);
+  read->buf = NULL;
+}
+
+/**
+ * @brief Check whether a conversion is the first of several of its selection
+ *
+ * Those are asked for with a single MULTIPLE request.
+ */
+static bool multiple_first(const XcbClipReadSpec *specs, size_t count, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    if ( specs[i].selection == specs[n].selection )
+      return false;
+
+  for (size_t i = n + 1; i < count; i++)
+    if ( specs[i].selection == specs[n].selection )
+      return true;
+
+  return false;
+}
+
+/**
+ * @brief Read selections and print them to standard output
+ * @param specs Selections and targets to read
+ * @param count Number of selections and targets
+ *
+ * All the conversions are asked for at once, each one into its own
+ * property, and go on in parallel; those of the same selection go in a
+ * single MULTIPLE request. A single conversion is written out
+ * as it's received; several are written as records by write_record(),
+ * in the order they were given.
+ */
+void do_out(const XcbClipReadSpec *specs, size_t count)
+{
+  XClipRead *reads = calloc(count, sizeof(XClipRead));
+  intern_atom_fast_cookie_t *cookies = calloc(count * 3, sizeof(intern_atom_fast_cookie_t));
+  if ( reads == NULL || cookies == NULL ) {
+    perrorf("%s: %s", progname, __FUNCTION__);
+    exit(EXIT_FAILURE);
+  }
+
+  /* the targets, the properties of all the conversions but the first
+   * and those of the MULTIPLE requests are interned together with the
+   * internal atoms
+   */
+  create_window();
+  intern_internal_atoms();
+  for (size_t i = 0; i < count; i++) {
+    char name[40];
+
+    if ( specs[i].target != NULL )
+      cookies[3 * i] = intern_atom_fast(xconn, false, strlen(specs[i].target),
+					specs[i].target);
+    if ( i > 0 ) {
+      snprintf(name, sizeof(name), "XCLIP_OUT_%zu", i);
+      cookies[3 * i + 1] = intern_atom_fast(xconn, false, strlen(name), name);
+    }
+    if ( multiple_first(specs, count, i) ) {
+      snprintf(name, sizeof(name), "XCLIP_MULTIPLE_%zu", i);
+      cookies[3 * i + 2] = intern_atom_fast(xconn, false, strlen(name), name);
+    }
+  }
+
+  setup_out();
+
+  for (size_t i = 0; i < count; i++) {
+    XClipRead *read = &reads[i];
+
+    read->selection = specs[i].selection == 'c' ? clipboard_atom :
+      specs[i].selection == 's' ? SECONDARY : PRIMARY;
+    read->text = specs[i].target == NULL;
+    read->buffered = count > 1;
+
+    if ( !read->text ) {
+      read->target = intern_atom_fast_reply(xconn, cookies[3 * i], 0);
+      stats.replies++;
+    }
+
+    if ( i > 0 ) {
+      read->property = intern_atom_fast_reply(xconn, cookies[3 * i + 1], 0);
+      stats.replies++;
+    } else
+      read->property = xclip_out_atom;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if ( multiple_first(specs, count, i) ) {
+      const xcb_atom_t pty = intern_atom_fast_reply(xconn, cookies[3 * i + 2], 0);
+      stats.replies++;
+      request_multiple(reads, count, reads[i].selection, pty);
+    } else if ( reads[i].multiple == XCB_NONE )
+      request_selection(&reads[i]);
+  }
+  free(cookies);
+
+  xcb_flush(xconn);
+  report_setup_time();
+  
+  xcb_generic_event_t *event;
+  size_t pending = count;	/* conversions not over yet */
+  size_t written = 0;		/* records written out */
+  double wait_start = stats_now();
+  /* the owner has --timeout to answer, and then to send each chunk */
+  double deadline = loop_deadline();
+  while (pending && (event = loop_wait_for_event(deadline))) {
+    bool incr = false;
+    for (size_t i = 0; i < count; i++)
+      incr = incr || (!reads[i].done && reads[i].context == XCLIP_OUT_INCR);
+    stats_add_time(incr ? XCBCLIP_PHASE_INCR_WAIT : XCBCLIP_PHASE_WAIT_OWNER,
+		   wait_start);
+
+    /* handle everything that is already queued, then send all the
+     * resulting requests in one go
+     */
+    do {
+      stats.events++;
+      /* a single MULTIPLE answer can finish several conversions */
+      if ( pending )
+	pending -= handle_out_event(reads, count, event);
+      free(event);
+    } while ((event = xcb_poll_for_event(xconn)));
+
+    if ( count > 1 )
+      for (; written < count && reads[written].done; written++)
+	write_record(&reads[written], &specs[written]);
+
+    xcb_flush(xconn);
+    wait_start = stats_now();
+    deadline = loop_deadline();
+  }
+
+  free(reads);
+  if ( pending == 0 )
+    return;
+  
+  /* if we reach here, event was NULL, and something bad happened */
+  if ( xcb_connection_has_error(xconn) )
+    fprintf(stderr, "%s: connection to X server lost\n", progname);
+  else
+    fprintf(stderr, "%s: timed out waiting for the selection owner\n",
+	    progname);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Print the selection every time it changes, until killed
+ * @param spec Selection to watch, and target to read it as
+ * @param separator Written after each value of the selection
+ * @param separator_len Length of separator
+ *
+ * XFIXES tells us whenever the selection gets a new owner, so the
+ * value is only read when it changed, on the one connection; nothing
+ * is sent to the server in between. Changes that come in while a value
+ * is being read are coalesced into a single read once it's over.
+ */
+void do_watch(const XcbClipReadSpec *spec,
+	      const char *separator, size_t separator_len)
+{
+#ifdef HAVE_XFIXES
+  /* the extension and the target are queried together with the atoms */
+  create_window();
+  intern_internal_atoms();
+  intern_atom_fast_cookie_t target_cookie;
+  if ( spec->target != NULL )
+    target_cookie = intern_atom_fast(xconn, false, strlen(spec->target),
+				     spec->target);
+  xcb_prefetch_extension_data(xconn, &xcb_xfixes_id);
+  setup_out();
+
+  XClipRead read = {
+    .selection = spec->selection == 'c' ? clipboard_atom :
+      spec->selection == 's' ? SECONDARY : PRIMARY,
+    .property = xclip_out_atom,
+    .text = spec->target == NULL
+  };
+  if ( !read.text ) {
+    read.target = intern_atom_fast_reply(xconn, target_cookie, 0);
+    stats.replies++;
+  }
+
+  const xcb_query_extension_reply_t *xfixes =
+    xcb_get_extension_data(xconn, &xcb_xfixes_id);
+  stats.replies++;
+  if ( xfixes == NULL || !xfixes->present ) {
+    fprintf(stderr, "%s: the X server has no XFIXES extension\n", progname);
+    exit(EXIT_FAILURE);
+  }
+
+  /* the version has to be negotiated before any other XFIXES request,
+   * but nothing in its reply is of use
+   */
+  xcb_discard_reply(xconn,
+		    xcb_xfixes_query_version(xconn, XCB_XFIXES_MAJOR_VERSION,
+					     XCB_XFIXES_MINOR_VERSION).sequence);
+  xcb_xfixes_select_selection_input(xconn, xwin, read.selection,
+				    XCB_XFIXES_SELECTION_EVENT_MASK_SET_SELECTION_OWNER);
+
+  /* the feed starts with the current value */
+  request_selection(&read);
+  xcb_flush(xconn);
+  report_setup_time();
+
+  bool reading = true;	/* a value is being read */
+  bool changed = false;	/* the selection changed since it was read */
+  xcb_window_t owner = XCB_NONE;
+  xcb_timestamp_t owner_time = XCB_CURRENT_TIME;
+
+  /* only the owner being read from can time out */
+  double deadline = loop_deadline();
+  xcb_generic_event_t *event;
+  while ((event = loop_wait_for_event(reading ? deadline : 0))) {
+    do {
+      stats.events++;
+
+      if ( (event->response_type & ~0x80) ==
+	   xfixes->first_event + XCB_XFIXES_SELECTION_NOTIFY ) {
+	const xcb_xfixes_selection_notify_event_t *notify =
+	  (xcb_xfixes_selection_notify_event_t *)event;
+
+	/* an owner taking the selection again without a new time stamp
+	 * didn't change it, and a selection with no owner has no value
+	 */
+	if ( notify->owner != owner || notify->selection_timestamp != owner_time ) {
+	  owner = notify->owner;
+	  owner_time = notify->selection_timestamp;
+	  changed = owner != XCB_NONE;
+	}
+      } else if ( reading && handle_out_event(&read, 1, event) ) {
+	reading = false;
+	if ( !read.refused )
+	  write_chunk(separator, separator_len, false);
+      }
+
+      free(event);
+    } while ((event = xcb_poll_for_event(xconn)));
+
+    if ( !reading && changed ) {
+      changed = false;
+      reading = true;
+      request_selection(&read);
+    }
+
+    deadline = loop_deadline();
+  }
 
-#ifdef VALGRIND_CLEAN
-  free(buf);
+  if ( xcb_connection_has_error(xconn) )
+    fprintf(stderr, "%s: connection to X server lost\n", progname);
+  else
+    fprintf(stderr, "%s: timed out waiting for the selection owner\n",
+	    progname);
+  exit(EXIT_FAILURE);
+#else
+  fprintf(stderr, "%s: built without XFIXES, selections can't be watched\n",
+	  progname);
+  exit(EXIT_FAILURE);
 #endif
 }